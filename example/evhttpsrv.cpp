@@ -1,5 +1,6 @@
 #include "e4pp/ev.hpp"
 #include "e4pp/http.hpp"
+#include "e4pp/http/router.hpp"
 #include "e4pp/util.hpp"
 #include "e4pp/thread.hpp"
 #include "e4pp/query.hpp"
@@ -102,6 +103,8 @@ int main()
         sterm.create(queue, SIGTERM, e4pp::ev_signal|e4pp::ev_persist, f);
         sterm.add();
 
+        // router переживает хосты, на которых установлен
+        e4pp::http::router router;
         e4pp::http::server srv{queue};
         e4pp::http::vhost localhost{queue, srv, "localhost"};
         auto bind_addr = "0.0.0.0";
@@ -114,10 +117,11 @@ int main()
         srv.set_allowed_methods(e4pp::http::method::post);
         srv.set_timeout(std::chrono::seconds{80});
         srv.set_flags(e4pp::http::lingering_close);
-        evhttp_set_cb(localhost, "/123", [](evhttp_request *req, void* q) {
-            cout() << "reply_start"sv << std::endl;
+        router.add(e4pp::http::method::post, "/{id}",
+            [&](e4pp::http::request_ref ref, const auto& params) {
+            evhttp_request* req = ref;
+            cout() << "reply_start "sv << params["id"] << std::endl;
             evhttp_send_reply_start(req, HTTP_OK, "ok");
-            auto& queue = *reinterpret_cast<e4pp::queue*>(q);
             queue.once(std::chrono::seconds{1}, [&, req]{
                 e4pp::buffer b;
                 b.append("{\"code\":200,\"message\":\"ok\"}"sv);
@@ -128,7 +132,8 @@ int main()
                     evhttp_send_reply_end(req);
                 });
             });
-        }, &queue);
+        });
+        router.attach(localhost);
 
         // test: curl -v http://localhost:27321/123
         // http post 1 byte per sec
@@ -0,0 +1,467 @@
+#pragma once
+
+#include "e4pp/buffer.hpp"
+#include "e4pp/simd.hpp"
+
+#include <span>
+#include <string>
+#include <stdexcept>
+#include <string_view>
+
+#if defined(E4PP_SIMD_X86) && !defined(E4PP_BASE64_SCALAR)
+#define E4PP_BASE64_X86
+#endif
+
+// base64 (RFC 4648) без BIO и без промежуточных аллокаций
+// на x86 выбирается AVX2 или SSSE3 по cpuid, иначе скалярный код
+// E4PP_BASE64_SCALAR отключает SIMD
+
+namespace e4pp {
+namespace base64 {
+
+static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+constexpr std::size_t encoded_size(std::size_t len) noexcept
+{
+    return (len + 2) / 3 * 4;
+}
+
+// верхняя граница без учета padding
+constexpr std::size_t decoded_max_size(std::size_t len) noexcept
+{
+    return (len + 3) / 4 * 3;
+}
+
+// точный размер результата, npos если длина некорректна
+constexpr std::size_t decoded_size(const char* in, std::size_t len) noexcept
+{
+    if (len && (in[len - 1] == '='))
+        --len;
+    if (len && (in[len - 1] == '='))
+        --len;
+
+    switch (len % 4)
+    {
+    case 1:
+        return npos;
+    case 2:
+        return len / 4 * 3 + 1;
+    case 3:
+        return len / 4 * 3 + 2;
+    default:
+        return len / 4 * 3;
+    }
+}
+
+constexpr std::size_t decoded_size(std::string_view in) noexcept
+{
+    return decoded_size(in.data(), in.size());
+}
+
+namespace detail {
+
+constexpr char encode_table[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+struct decode_table_type
+{
+    signed char value[256]{};
+
+    constexpr decode_table_type() noexcept
+    {
+        for (auto& v : value)
+            v = -1;
+        for (int i = 0; i < 64; ++i)
+            value[static_cast<unsigned char>(encode_table[i])] =
+                static_cast<signed char>(i);
+    }
+};
+
+inline constexpr decode_table_type decode_table{};
+
+inline void encode_scalar(const unsigned char*& in,
+    std::size_t& len, char*& out) noexcept
+{
+    auto p = in;
+    auto o = out;
+    for (; len >= 3; len -= 3, p += 3, o += 4)
+    {
+        unsigned v = (unsigned(p[0]) << 16) | (unsigned(p[1]) << 8) | p[2];
+        o[0] = encode_table[(v >> 18) & 0x3f];
+        o[1] = encode_table[(v >> 12) & 0x3f];
+        o[2] = encode_table[(v >> 6) & 0x3f];
+        o[3] = encode_table[v & 0x3f];
+    }
+
+    if (len)
+    {
+        unsigned v = unsigned(p[0]) << 16;
+        if (len == 2)
+            v |= unsigned(p[1]) << 8;
+        o[0] = encode_table[(v >> 18) & 0x3f];
+        o[1] = encode_table[(v >> 12) & 0x3f];
+        o[2] = (len == 2) ? encode_table[(v >> 6) & 0x3f] : '=';
+        o[3] = '=';
+        p += len;
+        o += 4;
+        len = 0;
+    }
+
+    in = p;
+    out = o;
+}
+
+// @return false если встретился недопустимый символ
+inline bool decode_scalar(const unsigned char*& in,
+    std::size_t& len, unsigned char*& out) noexcept
+{
+    auto p = in;
+    auto o = out;
+    auto& t = decode_table.value;
+
+    // padding допускается только в конце
+    auto n = len;
+    if (n && (p[n - 1] == '='))
+        --n;
+    if (n && (p[n - 1] == '='))
+        --n;
+    if ((n % 4) == 1)
+        return false;
+
+    for (; n >= 4; n -= 4, p += 4, o += 3)
+    {
+        int a = t[p[0]], b = t[p[1]], c = t[p[2]], d = t[p[3]];
+        if ((a | b | c | d) < 0)
+            return false;
+        unsigned v = (unsigned(a) << 18) | (unsigned(b) << 12) |
+            (unsigned(c) << 6) | unsigned(d);
+        o[0] = static_cast<unsigned char>(v >> 16);
+        o[1] = static_cast<unsigned char>(v >> 8);
+        o[2] = static_cast<unsigned char>(v);
+    }
+
+    if (n)
+    {
+        int a = t[p[0]], b = t[p[1]];
+        int c = (n == 3) ? t[p[2]] : 0;
+        if ((a | b | c) < 0)
+            return false;
+        unsigned v = (unsigned(a) << 18) | (unsigned(b) << 12) |
+            (unsigned(c) << 6);
+        *o++ = static_cast<unsigned char>(v >> 16);
+        if (n == 3)
+            *o++ = static_cast<unsigned char>(v >> 8);
+    }
+
+    in = p + len;
+    out = o;
+    len = 0;
+    return true;
+}
+
+#ifdef E4PP_BASE64_X86
+
+// 12 байт в 16 индексов 0..63 (W. Mula, D. Lemire)
+__attribute__((target("ssse3")))
+inline __m128i enc_reshuffle(__m128i in) noexcept
+{
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(
+        10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    auto t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    auto t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    auto t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    auto t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    return _mm_or_si128(t1, t3);
+}
+
+__attribute__((target("ssse3")))
+inline __m128i enc_translate(__m128i idx) noexcept
+{
+    const auto lut = _mm_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+        '/' - 63, 'A', 0, 0);
+    auto r = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+    auto less = _mm_cmpgt_epi8(_mm_set1_epi8(26), idx);
+    r = _mm_or_si128(r, _mm_and_si128(less, _mm_set1_epi8(13)));
+    return _mm_add_epi8(_mm_shuffle_epi8(lut, r), idx);
+}
+
+__attribute__((target("ssse3")))
+inline void encode_ssse3(const unsigned char*& in,
+    std::size_t& len, char*& out) noexcept
+{
+    // читаем 16 байт, используем 12
+    for (; len >= 16; len -= 12, in += 12, out += 16)
+    {
+        auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+        v = enc_translate(enc_reshuffle(v));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), v);
+    }
+}
+
+__attribute__((target("avx2")))
+inline void encode_avx2(const unsigned char*& in,
+    std::size_t& len, char*& out) noexcept
+{
+    const auto shuf = _mm256_set_epi8(
+        10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+        10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+    const auto lut = _mm256_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+        '/' - 63, 'A', 0, 0,
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+        '/' - 63, 'A', 0, 0);
+
+    // две половины по 12 байт, читаем до in + 28
+    for (; len >= 28; len -= 24, in += 24, out += 32)
+    {
+        auto v = _mm256_inserti128_si256(_mm256_castsi128_si256(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(in))),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 12)), 1);
+
+        v = _mm256_shuffle_epi8(v, shuf);
+        auto t0 = _mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00));
+        auto t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+        auto t2 = _mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0));
+        auto t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+        auto idx = _mm256_or_si256(t1, t3);
+
+        auto r = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+        auto less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx);
+        r = _mm256_or_si256(r, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+        r = _mm256_add_epi8(_mm256_shuffle_epi8(lut, r), idx);
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), r);
+    }
+}
+
+// проверка и перевод 16 символов в 12 байт
+// @return false если в блоке есть символ вне алфавита или '='
+__attribute__((target("ssse3")))
+inline bool dec_block_ssse3(__m128i str, __m128i& out) noexcept
+{
+    const auto lut_lo = _mm_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const auto lut_hi = _mm_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const auto lut_roll = _mm_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const auto mask_2f = _mm_set1_epi8(0x2f);
+
+    auto hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2f);
+    auto lo_nibbles = _mm_and_si128(str, mask_2f);
+    auto hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+    auto lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+    auto bad = _mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128());
+    if (_mm_movemask_epi8(bad) != 0xffff)
+        return false;
+
+    auto eq_2f = _mm_cmpeq_epi8(str, mask_2f);
+    auto roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+    str = _mm_add_epi8(str, roll);
+
+    auto ab_bc = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+    out = _mm_madd_epi16(ab_bc, _mm_set1_epi32(0x00011000));
+    out = _mm_shuffle_epi8(out, _mm_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    return true;
+}
+
+// пишет 16 байт на каждые 12 полезных, поэтому хвост
+// не меньше 8 символов остается скалярному коду
+__attribute__((target("ssse3")))
+inline void decode_ssse3(const unsigned char*& in,
+    std::size_t& len, unsigned char*& out) noexcept
+{
+    for (; len >= 24; len -= 16, in += 16, out += 12)
+    {
+        __m128i v;
+        if (!dec_block_ssse3(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(in)), v))
+            return;
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), v);
+    }
+}
+
+__attribute__((target("avx2")))
+inline void decode_avx2(const unsigned char*& in,
+    std::size_t& len, unsigned char*& out) noexcept
+{
+    const auto lut_lo = _mm256_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const auto lut_hi = _mm256_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const auto lut_roll = _mm256_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const auto mask_2f = _mm256_set1_epi8(0x2f);
+    const auto shuf = _mm256_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+    // 32 символа в 24 байта, запись до out + 28
+    for (; len >= 40; len -= 32, in += 32, out += 24)
+    {
+        auto str = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in));
+        auto hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+        auto lo_nibbles = _mm256_and_si256(str, mask_2f);
+        auto hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+        auto lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+        if (!_mm256_testz_si256(lo, hi))
+            return;
+
+        auto eq_2f = _mm256_cmpeq_epi8(str, mask_2f);
+        auto roll = _mm256_shuffle_epi8(lut_roll,
+            _mm256_add_epi8(eq_2f, hi_nibbles));
+        str = _mm256_add_epi8(str, roll);
+
+        auto ab_bc = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+        auto v = _mm256_madd_epi16(ab_bc, _mm256_set1_epi32(0x00011000));
+        v = _mm256_shuffle_epi8(v, shuf);
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out),
+            _mm256_castsi256_si128(v));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 12),
+            _mm256_extracti128_si256(v, 1));
+    }
+}
+
+#endif // E4PP_BASE64_X86
+
+} // namespace detail
+
+// out должен вмещать encoded_size(len)
+// @return количество записанных символов
+inline std::size_t encode(const void* in, std::size_t len, char* out) noexcept
+{
+    auto p = static_cast<const unsigned char*>(in);
+    auto o = out;
+#ifdef E4PP_BASE64_X86
+    auto level = e4pp::simd::current();
+    if (level == e4pp::simd::level::avx2)
+        detail::encode_avx2(p, len, o);
+    if (level >= e4pp::simd::level::ssse3)
+        detail::encode_ssse3(p, len, o);
+#endif // E4PP_BASE64_X86
+    detail::encode_scalar(p, len, o);
+    return static_cast<std::size_t>(o - out);
+}
+
+// out должен вмещать decoded_size(in, len)
+// @return количество записанных байт или npos
+inline std::size_t decode(const char* in, std::size_t len, void* out) noexcept
+{
+    auto p = reinterpret_cast<const unsigned char*>(in);
+    auto o = static_cast<unsigned char*>(out);
+#ifdef E4PP_BASE64_X86
+    auto level = e4pp::simd::current();
+    if (level == e4pp::simd::level::avx2)
+        detail::decode_avx2(p, len, o);
+    if (level >= e4pp::simd::level::ssse3)
+        detail::decode_ssse3(p, len, o);
+#endif // E4PP_BASE64_X86
+    if (!detail::decode_scalar(p, len, o))
+        return npos;
+    return static_cast<std::size_t>(o - static_cast<unsigned char*>(out));
+}
+
+inline std::size_t encode(std::span<const unsigned char> in,
+    std::span<char> out)
+{
+    if (out.size() < encoded_size(in.size()))
+        throw std::length_error("base64 encode");
+    return encode(in.data(), in.size(), out.data());
+}
+
+inline std::size_t decode(std::string_view in, std::span<unsigned char> out)
+{
+    auto size = decoded_size(in);
+    if (size == npos)
+        return npos;
+    if (out.size() < size)
+        throw std::length_error("base64 decode");
+    return decode(in.data(), in.size(), out.data());
+}
+
+inline std::string encode(const void* in, std::size_t len)
+{
+    std::string rc;
+    rc.resize(encoded_size(len));
+    encode(in, len, rc.data());
+    return rc;
+}
+
+inline std::string encode(std::string_view in)
+{
+    return encode(in.data(), in.size());
+}
+
+inline std::string decode(std::string_view in)
+{
+    std::string rc;
+    auto size = decoded_size(in);
+    if (size != npos)
+    {
+        rc.resize(size);
+        size = decode(in.data(), in.size(), rc.data());
+    }
+    if (size == npos)
+        throw std::runtime_error("base64 decode");
+    return rc;
+}
+
+// кодирует прямо в хвост evbuffer
+template<class A>
+void encode(basic_buffer<A>& buf, const void* in, std::size_t len)
+{
+    auto size = encoded_size(len);
+    if (!size)
+        return;
+
+    evbuffer_iovec vec{};
+    if (evbuffer_reserve_space(buf.handle(),
+        static_cast<ev_ssize_t>(size), &vec, 1) != 1)
+        throw std::runtime_error("evbuffer_reserve_space");
+
+    vec.iov_len = encode(in, len, static_cast<char*>(vec.iov_base));
+    e4pp::detail::check_result("evbuffer_commit_space",
+        evbuffer_commit_space(buf.handle(), &vec, 1));
+}
+
+// декодирует прямо в хвост evbuffer
+// @return количество байт или npos, при ошибке буфер не меняется
+template<class A>
+std::size_t decode(basic_buffer<A>& buf, std::string_view in)
+{
+    auto size = decoded_size(in);
+    if (!size || (size == npos))
+        return size;
+
+    evbuffer_iovec vec{};
+    if (evbuffer_reserve_space(buf.handle(),
+        static_cast<ev_ssize_t>(size), &vec, 1) != 1)
+        throw std::runtime_error("evbuffer_reserve_space");
+
+    size = decode(in.data(), in.size(), vec.iov_base);
+    if (size == npos)
+        return size;
+
+    vec.iov_len = size;
+    e4pp::detail::check_result("evbuffer_commit_space",
+        evbuffer_commit_space(buf.handle(), &vec, 1));
+    return size;
+}
+
+} // namespace base64
+} // namespace e4pp
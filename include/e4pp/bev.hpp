@@ -1,7 +1,7 @@
 #pragma once
 
 #include "e4pp/dns.hpp"
-#include "e4pp/queue.hpp"
+#include "e4pp/buffer.hpp"
 #include <event2/bufferevent.h>
 #include <memory>
 
@@ -363,14 +363,16 @@ public:
     }
 
     // Read data from an evbuffer and drain the bytes read.
-    std::size_t remove(basic_buffer& out, std::size_t len) const
+    template<class B>
+    std::size_t remove(basic_buffer<B>& out, std::size_t len) const
     {
         return detail::check_size("evbuffer_remove_buffer",
             evbuffer_remove_buffer(assert_handle(), out, len));
     }
 
     // Read data from an evbuffer and drain the bytes read.
-    std::size_t remove(basic_buffer& out) const
+    template<class B>
+    std::size_t remove(basic_buffer<B>& out) const
     {
         auto len = size();
         return (len) ?
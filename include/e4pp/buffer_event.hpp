@@ -9,6 +9,55 @@
 namespace e4pp {
 namespace detail {
 
+// libevent не раскрывает емкость цепочек, размеры оцениваются:
+// чтение из сокета выделяет цепочку до EVBUFFER_MAX_READ (4096),
+// новая цепочка округляется до степени двойки не меньше 1024
+constexpr std::size_t read_chain_size = 4096;
+
+inline std::size_t chain_size(std::size_t len) noexcept
+{
+    std::size_t rc = 1024;
+    while (rc < len)
+        rc <<= 1;
+    return rc;
+}
+
+// переносит остаток input в одну цепочку по размеру данных
+// хвост input заморожен bufferevent, поэтому данные собираются
+// во временном буфере и вставляются в начало
+// при ошибке выделения input не меняется
+// @return оценка освобожденных байт
+inline std::size_t repack_input(evbuffer* input, std::size_t limit)
+{
+    assert(input);
+
+    auto len = evbuffer_get_length(input);
+    if (!len || (len > limit))
+        return 0;
+
+    auto chains = static_cast<std::size_t>(
+        evbuffer_peek(input, -1, nullptr, nullptr, 0));
+    auto before = chains * (std::max)(read_chain_size, chain_size(len));
+    auto after = chain_size(len);
+    if (before <= after)
+        return 0;
+
+    buffer tmp;
+    evbuffer_iovec vec{};
+    if (evbuffer_reserve_space(tmp, static_cast<ev_ssize_t>(len),
+        &vec, 1) != 1)
+        return 0;
+    vec.iov_len = len;
+    evbuffer_copyout(input, vec.iov_base, len);
+    if (evbuffer_commit_space(tmp, &vec, 1))
+        return 0;
+
+    check_result("evbuffer_drain", evbuffer_drain(input, len));
+    check_result("evbuffer_prepend_buffer",
+        evbuffer_prepend_buffer(input, tmp));
+    return before - after;
+}
+
 struct buffer_event_base
 {
     virtual buffer_event_ptr release() noexcept = 0;
@@ -195,6 +244,45 @@ struct buffer_event_base
     {
         bufferevent_set_timeouts(handle(), timeout_read, timeout_write);
     }    
+
+    // per-connection token bucket, applied together with the group limit
+    // cfg is not copied and must outlive its use (see token_bucket)
+    void set_rate_limit(ev_token_bucket_cfg* cfg)
+    {
+        detail::check_result("bufferevent_set_rate_limit",
+            bufferevent_set_rate_limit(handle(), cfg));
+    }
+
+    void remove_rate_limit()
+    {
+        set_rate_limit(nullptr);
+    }
+
+    ev_ssize_t get_read_limit() const noexcept
+    {
+        return bufferevent_get_read_limit(handle());
+    }
+
+    ev_ssize_t get_write_limit() const noexcept
+    {
+        return bufferevent_get_write_limit(handle());
+    }
+
+    // compact a small input remainder (up to limit bytes) into one
+    // right-sized chain; fully read buffers hold no chains, libevent
+    // frees them on drain. Call on idle connections, see idle_reclaim
+    // @return estimated bytes freed
+    std::size_t reclaim(std::size_t limit = 2048)
+    {
+        return detail::repack_input(input_handle(), limit);
+    }
+
+    // for pairs BEV_FINISHED delivers EOF to the partner
+    void flush(short iotype, bufferevent_flush_mode mode)
+    {
+        detail::check_result("bufferevent_flush",
+            bufferevent_flush(handle(), iotype, mode));
+    }
 };
 
 } // namespace detail
@@ -383,6 +471,184 @@ public:
     }
 };
 
+// half of a bufferevent pair
+// bufferevent_free on a pair only unlinks the partner, so the half
+// flushes BEV_FINISHED first and the partner (or the bridge between
+// queues) receives EOF; a half already finished by hand repeats EOF
+class pair_bev final
+    : public bev
+{
+public:
+    using bev::bev;
+
+    pair_bev() = default;
+    pair_bev(pair_bev&&) = default;
+
+    pair_bev& operator=(pair_bev&& other) noexcept
+    {
+        if (this != &other)
+        {
+            shutdown();
+            bev::operator=(std::move(other));
+        }
+        return *this;
+    }
+
+    ~pair_bev() override
+    {
+        shutdown();
+    }
+
+    void reset() noexcept
+    {
+        shutdown();
+        bev::reset();
+    }
+
+    void reset(handle_type ptr) noexcept
+    {
+        shutdown();
+        bev::reset(ptr);
+    }
+
+    void shutdown() noexcept override
+    {
+        auto h = handle();
+        if (h)
+            bufferevent_flush(h, EV_WRITE, BEV_FINISHED);
+    }
+};
+
+using pair_buffer_event = basic_buffer_event<pair_bev>;
+
+namespace detail {
+
+// joins two pairs living on different queues
+// bufferevent_base_set works only for socket bufferevents,
+// so each queue gets its own pair and the inner halves forward chains
+// to each other; the bridge frees itself after both inner halves see EOF
+class buffer_event_bridge final
+{
+    std::mutex mutex_{};
+    buffer_event_ptr near_{};
+    buffer_event_ptr far_{};
+
+    buffer_event_ptr& self(buffer_event_ptr bev) noexcept
+    {
+        return (bev == near_) ? near_ : far_;
+    }
+
+    buffer_event_ptr peer(buffer_event_ptr bev) const noexcept
+    {
+        return (bev == near_) ? far_ : near_;
+    }
+
+    // callbacks run unlocked (BEV_OPT_UNLOCK_CALLBACKS), the bridge mutex
+    // is always taken before any bufferevent lock
+    static void readcb(bufferevent* bev, void* arg) noexcept
+    {
+        assert(arg);
+        auto self = static_cast<buffer_event_bridge*>(arg);
+        std::lock_guard<std::mutex> l{self->mutex_};
+        auto to = self->peer(bev);
+        if (to)
+            bufferevent_write_buffer(to, bufferevent_get_input(bev));
+    }
+
+    static void eventcb(bufferevent* bev, short what, void* arg) noexcept
+    {
+        assert(arg);
+        if (!(what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)))
+            return;
+
+        auto self = static_cast<buffer_event_bridge*>(arg);
+        bool last = false;
+        {
+            std::lock_guard<std::mutex> l{self->mutex_};
+            auto to = self->peer(bev);
+            if (to)
+            {
+                bufferevent_write_buffer(to, bufferevent_get_input(bev));
+                bufferevent_flush(to, EV_WRITE, BEV_FINISHED);
+            }
+            bufferevent_setcb(bev, nullptr, nullptr, nullptr, nullptr);
+            bufferevent_free(bev);
+            self->self(bev) = nullptr;
+            last = !(self->near_ || self->far_);
+        }
+
+        if (last)
+            delete self;
+    }
+
+public:
+    buffer_event_bridge(buffer_event_ptr near, buffer_event_ptr far) noexcept
+        : near_{near}
+        , far_{far}
+    {
+        assert(near && far);
+    }
+
+    void start()
+    {
+        std::lock_guard<std::mutex> l{mutex_};
+        for (auto bev : {near_, far_})
+        {
+            bufferevent_setcb(bev, readcb, nullptr, eventcb, this);
+            detail::check_result("bufferevent_enable",
+                bufferevent_enable(bev, EV_READ|EV_WRITE));
+        }
+    }
+};
+
+} // namespace detail
+
+// in-process loopback, both halves on the same queue
+static inline auto make_buffer_event_pair(queue_handle_type queue,
+    bev_flag opt = bev_close_on_free)
+{
+    assert(queue);
+    buffer_event_ptr pair[2]{};
+    detail::check_result("bufferevent_pair_new",
+        bufferevent_pair_new(queue, opt, pair));
+    return std::make_pair(pair_buffer_event{pair_bev{pair[0]}},
+        pair_buffer_event{pair_bev{pair[1]}});
+}
+
+// halves on different queues, each half runs its callbacks on its own
+// queue; requires use_threads(), callbacks are deferred and unlocked
+// freeing a half sends EOF through the bridge, the bridge and its
+// inner halves go away once both outer halves are freed
+static inline auto make_buffer_event_pair(queue_handle_type first,
+    queue_handle_type second, bev_flag opt = bev_close_on_free)
+{
+    assert(first && second);
+    if (first == second)
+        return make_buffer_event_pair(first, opt);
+
+    auto flags = static_cast<int>(opt)|BEV_OPT_THREADSAFE|
+        BEV_OPT_DEFER_CALLBACKS|BEV_OPT_UNLOCK_CALLBACKS;
+
+    buffer_event_ptr a[2]{};
+    detail::check_result("bufferevent_pair_new",
+        bufferevent_pair_new(first, flags, a));
+    auto result = std::make_pair(pair_buffer_event{pair_bev{a[0]}},
+        pair_buffer_event{});
+    bev inner_a{a[1]};
+
+    buffer_event_ptr b[2]{};
+    detail::check_result("bufferevent_pair_new",
+        bufferevent_pair_new(second, flags, b));
+    result.second = pair_buffer_event{pair_bev{b[1]}};
+    bev inner_b{b[0]};
+
+    auto bridge = new detail::buffer_event_bridge{inner_a.release(),
+        inner_b.release()};
+    bridge->start();
+
+    return result;
+}
+
 // Free functions for swap (ADL)
 template<class T>
 inline void swap(basic_buffer_event<T>& a, 
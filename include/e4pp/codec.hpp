@@ -0,0 +1,474 @@
+#pragma once
+
+#include "e4pp/buffer.hpp"
+
+#include <array>
+#include <limits>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+namespace e4pp {
+namespace codec {
+
+// все примитивы constexpr, их можно проверять через static_assert
+
+template<class T>
+constexpr T load_be(const unsigned char* ptr) noexcept
+{
+    static_assert(std::is_integral_v<T>);
+    using U = std::make_unsigned_t<T>;
+    U value{};
+    for (std::size_t i = 0; i < sizeof(T); ++i)
+        value = static_cast<U>((value << 8) | ptr[i]);
+    return static_cast<T>(value);
+}
+
+template<class T>
+constexpr T load_le(const unsigned char* ptr) noexcept
+{
+    static_assert(std::is_integral_v<T>);
+    using U = std::make_unsigned_t<T>;
+    U value{};
+    for (std::size_t i = sizeof(T); i > 0; --i)
+        value = static_cast<U>((value << 8) | ptr[i - 1]);
+    return static_cast<T>(value);
+}
+
+template<class T>
+constexpr void store_be(unsigned char* ptr, T value) noexcept
+{
+    static_assert(std::is_integral_v<T>);
+    auto v = static_cast<std::make_unsigned_t<T>>(value);
+    for (std::size_t i = sizeof(T); i > 0; --i, v >>= 8)
+        ptr[i - 1] = static_cast<unsigned char>(v & 0xff);
+}
+
+template<class T>
+constexpr void store_le(unsigned char* ptr, T value) noexcept
+{
+    static_assert(std::is_integral_v<T>);
+    auto v = static_cast<std::make_unsigned_t<T>>(value);
+    for (std::size_t i = 0; i < sizeof(T); ++i, v >>= 8)
+        ptr[i] = static_cast<unsigned char>(v & 0xff);
+}
+
+// максимальная длина LEB128 для типа
+template<class T>
+constexpr std::size_t varint_max_size() noexcept
+{
+    return (sizeof(T) * 8 + 6) / 7;
+}
+
+template<class T>
+constexpr auto zigzag_encode(T value) noexcept
+{
+    static_assert(std::is_signed_v<T>);
+    using U = std::make_unsigned_t<T>;
+    return static_cast<U>((static_cast<U>(value) << 1) ^
+        static_cast<U>(value >> (sizeof(T) * 8 - 1)));
+}
+
+template<class U>
+constexpr auto zigzag_decode(U value) noexcept
+{
+    static_assert(std::is_unsigned_v<U>);
+    using T = std::make_signed_t<U>;
+    return static_cast<T>((value >> 1) ^ (~(value & 1) + 1));
+}
+
+template<class T>
+constexpr std::size_t varint_size(T value) noexcept
+{
+    static_assert(std::is_unsigned_v<T>);
+    std::size_t size = 1;
+    while (value >= 0x80)
+    {
+        value >>= 7;
+        ++size;
+    }
+    return size;
+}
+
+// пишет LEB128, возвращает количество записанных байт
+// в out должно быть не меньше varint_size(value) байт
+template<class T>
+constexpr std::size_t encode_varint(unsigned char* out, T value) noexcept
+{
+    static_assert(std::is_unsigned_v<T>);
+    std::size_t i = 0;
+    while (value >= 0x80)
+    {
+        out[i++] = static_cast<unsigned char>(value | 0x80);
+        value >>= 7;
+    }
+    out[i++] = static_cast<unsigned char>(value);
+    return i;
+}
+
+// читает LEB128 из непрерывного участка
+// @return количество прочитанных байт или 0 если данных недостаточно
+// бросает исключение если значение не помещается в T
+template<class T>
+constexpr std::size_t decode_varint(const unsigned char* ptr,
+    std::size_t len, T& value)
+{
+    static_assert(std::is_unsigned_v<T>);
+    constexpr auto max_size = varint_max_size<T>();
+    constexpr auto bits = sizeof(T) * 8;
+
+    T result{};
+    auto n = (len < max_size) ? len : max_size;
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        auto b = ptr[i];
+        auto shift = 7 * i;
+        // последний байт не может нести больше бит чем осталось в T
+        if ((i + 1 == max_size) && ((b & 0x80) || (b >> (bits - shift))))
+            throw std::runtime_error("varint overflow");
+
+        result |= static_cast<T>(static_cast<T>(b & 0x7f) << shift);
+        if (!(b & 0x80))
+        {
+            value = result;
+            return i + 1;
+        }
+    }
+
+    return 0;
+}
+
+} // namespace codec
+
+// курсор чтения поверх evbuffer
+// не линеаризует буфер и не изменяет его
+// после разбора вызывающий делает drain(position())
+class buffer_reader final
+{
+    evbufer_ptr buf_{};
+    // начало текущего сегмента
+    evbuffer_ptr pos_{};
+    std::size_t size_{};
+    // текущий сегмент и смещение курсора в нем
+    const unsigned char* seg_{};
+    std::size_t seg_len_{};
+    std::size_t seg_off_{};
+
+    void load_segment() noexcept
+    {
+        seg_ = nullptr;
+        seg_len_ = 0;
+        seg_off_ = 0;
+        // evbuffer_peek не принимает позицию за концом буфера
+        if (static_cast<std::size_t>(pos_.pos) < size_)
+        {
+            evbuffer_iovec vec{};
+            if (evbuffer_peek(buf_, -1, &pos_, &vec, 1) > 0)
+            {
+                seg_ = static_cast<const unsigned char*>(vec.iov_base);
+                seg_len_ = vec.iov_len;
+            }
+        }
+    }
+
+    std::size_t available() const noexcept
+    {
+        return seg_len_ - seg_off_;
+    }
+
+    const unsigned char* current() const noexcept
+    {
+        return seg_ + seg_off_;
+    }
+
+    void advance(std::size_t len)
+    {
+        assert(len <= remaining());
+        if (len < available())
+        {
+            // внутри текущего сегмента цепочку не трогаем
+            seg_off_ += len;
+        }
+        else
+        {
+            detail::check_result("evbuffer_ptr_set",
+                evbuffer_ptr_set(buf_, &pos_, seg_off_ + len,
+                    EVBUFFER_PTR_ADD));
+            load_segment();
+        }
+    }
+
+    void copy(void* out, std::size_t len) const
+    {
+        auto pos = pos_;
+        detail::check_result("evbuffer_ptr_set",
+            evbuffer_ptr_set(buf_, &pos, seg_off_, EVBUFFER_PTR_ADD));
+        detail::check_size("evbuffer_copyout_from",
+            evbuffer_copyout_from(buf_, &pos, out, len));
+    }
+
+    template<class T, class F>
+    bool read_fixed(T& value, F load)
+    {
+        if (remaining() < sizeof(T))
+            return false;
+
+        if (sizeof(T) <= available())
+        {
+            // быстрый путь - значение в текущем сегменте
+            value = load(current());
+        }
+        else
+        {
+            // значение на стыке сегментов
+            std::array<unsigned char, sizeof(T)> tmp;
+            copy(tmp.data(), tmp.size());
+            value = load(tmp.data());
+        }
+
+        advance(sizeof(T));
+        return true;
+    }
+
+public:
+    explicit buffer_reader(evbufer_ptr buf) noexcept
+        : buf_{buf}
+        , size_{evbuffer_get_length(buf)}
+    {
+        assert(buf);
+        evbuffer_ptr_set(buf_, &pos_, 0, EVBUFFER_PTR_SET);
+        load_segment();
+    }
+
+    template<class A>
+    explicit buffer_reader(const basic_buffer<A>& buf) noexcept
+        : buffer_reader{buf.handle()}
+    {   }
+
+    // сколько байт прочитано
+    std::size_t position() const noexcept
+    {
+        return static_cast<std::size_t>(pos_.pos) + seg_off_;
+    }
+
+    std::size_t remaining() const noexcept
+    {
+        return size_ - position();
+    }
+
+    bool empty() const noexcept
+    {
+        return 0 == remaining();
+    }
+
+    // непрерывный участок начиная с позиции курсора
+    std::span<const unsigned char> segment() const noexcept
+    {
+        return {current(), available()};
+    }
+
+    bool skip(std::size_t len)
+    {
+        if (remaining() < len)
+            return false;
+        advance(len);
+        return true;
+    }
+
+    bool read(void* out, std::size_t len)
+    {
+        if (remaining() < len)
+            return false;
+        if (len)
+        {
+            copy(out, len);
+            advance(len);
+        }
+        return true;
+    }
+
+    template<class T>
+    bool read_be(T& value)
+    {
+        return read_fixed(value, codec::load_be<T>);
+    }
+
+    template<class T>
+    bool read_le(T& value)
+    {
+        return read_fixed(value, codec::load_le<T>);
+    }
+
+    // LEB128, для знаковых типов zigzag
+    template<class T>
+    bool read_varint(T& value)
+    {
+        static_assert(std::is_integral_v<T>);
+        using U = std::make_unsigned_t<T>;
+
+        U result{};
+        auto len = codec::decode_varint(current(), available(), result);
+        if (!len && (available() < remaining()))
+        {
+            // значение на стыке сегментов
+            std::array<unsigned char, codec::varint_max_size<U>()> tmp;
+            auto n = (std::min)(tmp.size(), remaining());
+            copy(tmp.data(), n);
+            len = codec::decode_varint(tmp.data(), n, result);
+        }
+
+        if (!len)
+            return false;
+
+        if constexpr (std::is_signed_v<T>)
+            value = codec::zigzag_decode(result);
+        else
+            value = result;
+
+        advance(len);
+        return true;
+    }
+
+    // строка с префиксом длины в LEB128
+    // курсор не двигается если строка не пришла целиком
+    bool read_string(std::string& value,
+        std::size_t max_size = (std::numeric_limits<std::size_t>::max)())
+    {
+        auto save = *this;
+        std::size_t len{};
+        if (!read_varint(len))
+            return false;
+
+        if (len > max_size)
+            throw std::runtime_error("string too long");
+
+        if (remaining() < len)
+        {
+            *this = save;
+            return false;
+        }
+
+        value.resize(len);
+        return read(value.data(), len);
+    }
+};
+
+// запись через зарезервированное место в evbuffer
+// данные становятся видны в буфере после commit()
+// пока идет запись нельзя выполнять других операций с буфером
+class buffer_writer final
+{
+    evbufer_ptr buf_{};
+    evbuffer_iovec vec_{};
+    std::size_t used_{};
+    std::size_t reserve_{};
+
+    unsigned char* ensure(std::size_t len)
+    {
+        if (vec_.iov_len - used_ < len)
+        {
+            commit();
+            auto size = (std::max)(len, reserve_);
+            auto n = detail::check_result("evbuffer_reserve_space",
+                evbuffer_reserve_space(buf_,
+                    static_cast<ev_ssize_t>(size), &vec_, 1));
+            if (n != 1)
+                throw std::runtime_error("evbuffer_reserve_space");
+        }
+        return static_cast<unsigned char*>(vec_.iov_base) + used_;
+    }
+
+public:
+    static constexpr std::size_t default_reserve = 4096;
+
+    explicit buffer_writer(evbufer_ptr buf,
+        std::size_t reserve = default_reserve) noexcept
+        : buf_{buf}
+        , reserve_{reserve}
+    {
+        assert(buf);
+    }
+
+    template<class A>
+    explicit buffer_writer(basic_buffer<A>& buf,
+        std::size_t reserve = default_reserve) noexcept
+        : buffer_writer{buf.handle(), reserve}
+    {   }
+
+    buffer_writer(const buffer_writer&) = delete;
+    buffer_writer& operator=(const buffer_writer&) = delete;
+
+    ~buffer_writer() noexcept
+    {
+        try {
+            commit();
+        }
+        catch (...)
+        {   }
+    }
+
+    // фиксирует записанное, остаток резерва возвращается буферу
+    void commit()
+    {
+        if (vec_.iov_base && used_)
+        {
+            vec_.iov_len = used_;
+            auto rc = evbuffer_commit_space(buf_, &vec_, 1);
+            vec_ = {};
+            used_ = 0;
+            detail::check_result("evbuffer_commit_space", rc);
+        }
+        else
+        {
+            // незаполненный резерв просто отбрасываем
+            vec_ = {};
+        }
+    }
+
+    void write(const void* data, std::size_t len)
+    {
+        if (len)
+        {
+            assert(data);
+            std::memcpy(ensure(len), data, len);
+            used_ += len;
+        }
+    }
+
+    template<class T>
+    void write_be(T value)
+    {
+        codec::store_be(ensure(sizeof(T)), value);
+        used_ += sizeof(T);
+    }
+
+    template<class T>
+    void write_le(T value)
+    {
+        codec::store_le(ensure(sizeof(T)), value);
+        used_ += sizeof(T);
+    }
+
+    // LEB128, для знаковых типов zigzag
+    template<class T>
+    void write_varint(T value)
+    {
+        static_assert(std::is_integral_v<T>);
+        using U = std::make_unsigned_t<T>;
+        auto ptr = ensure(codec::varint_max_size<U>());
+        if constexpr (std::is_signed_v<T>)
+            used_ += codec::encode_varint(ptr, codec::zigzag_encode(value));
+        else
+            used_ += codec::encode_varint(ptr, value);
+    }
+
+    // строка с префиксом длины в LEB128
+    void write_string(std::string_view value)
+    {
+        write_varint(value.size());
+        write(value.data(), value.size());
+    }
+};
+
+} // namespace e4pp
@@ -0,0 +1,298 @@
+#pragma once
+
+#include "e4pp/codec.hpp"
+#include "e4pp/buffer_event.hpp"
+
+namespace e4pp {
+
+enum class frame_prefix
+{
+    be16,
+    be32,
+    varint
+};
+
+// сообщения с префиксом длины поверх buffer_event
+// read watermark выставляется на длину недостающего фрейма
+// поэтому bufferevent будит нас только когда фрейм пришел целиком
+// объект передает this в калбеки bufferevent и не должен перемещаться
+template<class T>
+class framed_stream final
+{
+public:
+    using frame_fn_type = void (T::*)(buffer frame);
+    using event_fn_type = void (T::*)(short what);
+    using self_type = T;
+
+    static constexpr std::size_t default_max_frame_size = 16 * 1024 * 1024;
+
+private:
+    T& self_;
+    frame_fn_type frame_fn_{};
+    event_fn_type event_fn_{};
+    buffer_event_ref bev_{};
+    frame_prefix prefix_{frame_prefix::be32};
+    std::size_t max_frame_size_{default_max_frame_size};
+
+    std::size_t min_header_size() const noexcept
+    {
+        switch (prefix_)
+        {
+        case frame_prefix::be16:
+            return sizeof(std::uint16_t);
+        case frame_prefix::be32:
+            return sizeof(std::uint32_t);
+        default:
+            return 1;
+        }
+    }
+
+    // @return false если заголовок еще не пришел целиком
+    bool read_header(buffer_reader& reader, std::size_t& len) const
+    {
+        switch (prefix_)
+        {
+        case frame_prefix::be16: {
+            std::uint16_t val{};
+            if (!reader.read_be(val))
+                return false;
+            len = val;
+            return true;
+        }
+        case frame_prefix::be32: {
+            std::uint32_t val{};
+            if (!reader.read_be(val))
+                return false;
+            len = val;
+            return true;
+        }
+        default:
+            return reader.read_varint(len);
+        }
+    }
+
+    void call(short what) noexcept
+    {
+        assert(event_fn_);
+        try {
+            (self_.*event_fn_)(what);
+        }
+        catch (...)
+        {   }
+    }
+
+    void call(buffer frame) noexcept
+    {
+        assert(frame_fn_);
+        try {
+            (self_.*frame_fn_)(std::move(frame));
+        }
+        catch (...)
+        {   }
+    }
+
+    // поток дальше не разобрать, чтение останавливается
+    void read_error()
+    {
+        bev_.disable(EV_READ);
+        call(static_cast<short>(BEV_EVENT_READING|BEV_EVENT_ERROR));
+    }
+
+    void on_read()
+    {
+        auto input = bev_.input();
+        // сколько нужно для следующего шага разбора
+        std::size_t want = min_header_size();
+        // обработчик может закрыть поток из калбека
+        while (bev_)
+        {
+            auto size = input.size();
+            if (size < want)
+                break;
+
+            buffer_reader reader{input};
+            std::size_t len{};
+            bool complete{};
+            try {
+                complete = read_header(reader, len);
+            }
+            catch (const std::exception&)
+            {
+                // varint не помещается в size_t
+                read_error();
+                return;
+            }
+
+            if (!complete)
+            {
+                // varint заголовок не дочитан, ждем еще байт
+                want = size + 1;
+                break;
+            }
+
+            if (len > max_frame_size_)
+            {
+                read_error();
+                return;
+            }
+
+            auto header = reader.position();
+            if (size < header + len)
+            {
+                want = header + len;
+                break;
+            }
+
+            input.drain(header);
+            buffer frame;
+            if (len)
+                input.remove(frame, len);
+            want = min_header_size();
+
+            call(std::move(frame));
+        }
+
+        if (bev_)
+            bev_.set_watermark(EV_READ, want, 0);
+    }
+
+    static void readcb(bufferevent*, void* arg) noexcept
+    {
+        assert(arg);
+        try {
+            static_cast<framed_stream*>(arg)->on_read();
+        }
+        catch (...)
+        {   }
+    }
+
+    static void writecb(bufferevent*, void* arg) noexcept
+    {
+        assert(arg);
+        static_cast<framed_stream*>(arg)->call(EV_WRITE);
+    }
+
+    static void eventcb(bufferevent*, short what, void* arg) noexcept
+    {
+        assert(arg);
+        static_cast<framed_stream*>(arg)->call(what);
+    }
+
+    void write_header(std::size_t len)
+    {
+        if (len > max_frame_size_)
+            throw std::length_error("frame too long");
+
+        std::array<unsigned char,
+            codec::varint_max_size<std::size_t>()> header;
+        std::size_t header_size{};
+        switch (prefix_)
+        {
+        case frame_prefix::be16:
+            if (len > 0xffff)
+                throw std::length_error("frame too long");
+            codec::store_be(header.data(), static_cast<std::uint16_t>(len));
+            header_size = sizeof(std::uint16_t);
+            break;
+        case frame_prefix::be32:
+            if (len > 0xffffffff)
+                throw std::length_error("frame too long");
+            codec::store_be(header.data(), static_cast<std::uint32_t>(len));
+            header_size = sizeof(std::uint32_t);
+            break;
+        default:
+            header_size = codec::encode_varint(header.data(), len);
+        }
+
+        bev_.write(header.data(), header_size);
+    }
+
+public:
+    framed_stream(T& self, frame_fn_type frame_fn, event_fn_type event_fn,
+        frame_prefix prefix = frame_prefix::be32,
+        std::size_t max_frame_size = default_max_frame_size) noexcept
+        : self_{self}
+        , frame_fn_{frame_fn}
+        , event_fn_{event_fn}
+        , prefix_{prefix}
+        , max_frame_size_{max_frame_size}
+    {
+        assert(frame_fn && event_fn);
+    }
+
+    framed_stream(const framed_stream&) = delete;
+    framed_stream& operator=(const framed_stream&) = delete;
+
+    // перехватывает калбеки bufferevent и включает чтение
+    // buffer_event должен жить дольше чем он подключен к потоку
+    void attach(buffer_event_ref bev)
+    {
+        assert(bev);
+        bev_ = bev;
+        bev_.set(readcb, writecb, eventcb, this);
+        bev_.set_watermark(EV_READ, min_header_size(), 0);
+        bev_.enable(EV_READ);
+        // фреймы могли прийти до подключения
+        if (!bev_.input().empty())
+            on_read();
+    }
+
+    template<class B>
+    void attach(basic_buffer_event<B>& bev)
+    {
+        attach(buffer_event_ref{bev.handle()});
+    }
+
+    void detach() noexcept
+    {
+        if (bev_)
+        {
+            bev_.set(nullptr, nullptr, nullptr, nullptr);
+            bev_.set_watermark(EV_READ, 0, 0);
+            bev_.reset();
+        }
+    }
+
+    buffer_event_ref handle() const noexcept
+    {
+        return bev_;
+    }
+
+    void write(const void* data, std::size_t len)
+    {
+        assert(bev_);
+        write_header(len);
+        if (len)
+            bev_.write(data, len);
+    }
+
+    void write(std::string_view data)
+    {
+        write(data.data(), data.size());
+    }
+
+    // данные переносятся цепочками без копирования
+    void write(buffer frame)
+    {
+        assert(bev_);
+        write_header(frame.size());
+        bev_.write(std::move(frame));
+    }
+
+    void set_max_frame_size(std::size_t value) noexcept
+    {
+        max_frame_size_ = value;
+    }
+
+    std::size_t max_frame_size() const noexcept
+    {
+        return max_frame_size_;
+    }
+
+    frame_prefix prefix() const noexcept
+    {
+        return prefix_;
+    }
+};
+
+} // namespace e4pp
@@ -0,0 +1,422 @@
+#pragma once
+
+#include "e4pp/uri.hpp"
+#include "e4pp/evtype.hpp"
+#include "e4pp/http/connection.hpp"
+#include <list>
+#include <algorithm>
+#include <deque>
+#include <chrono>
+#include <string>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+
+namespace e4pp {
+namespace http {
+
+struct client_pool_options
+{
+    // соединений на один origin
+    std::size_t max_connections{8};
+    // ожидающих запросов на один origin, 0 - без ограничения
+    std::size_t max_waiting{1024};
+    // простаивающее соединение закрывается, 0 - никогда
+    std::chrono::milliseconds idle_timeout{60000};
+    // 0 - значения evhttp по умолчанию
+    std::chrono::milliseconds connect_timeout{};
+    std::chrono::milliseconds timeout{};
+};
+
+// keep-alive соединения evhttp по ключу scheme://host:port
+// запрос уходит в свободное соединение (последнее освободившееся),
+// иначе в новое до max_connections, иначе ждет в очереди origin
+// одно соединение ведет один запрос за раз, закрытый сервером
+// сокет evhttp_connection переподключает сам на следующем запросе
+// калбеки вызываются в очереди пула, в них можно делать новые запросы,
+// но нельзя удалять пул
+// объект передает this в калбеки и не должен перемещаться
+class client_pool final
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    struct origin final
+    {
+        std::string scheme{"http"};
+        std::string host{};
+        ev_uint16_t port{};
+    };
+
+    // bufferevent нового соединения, например SSL для https
+    // nullptr - evhttp создаст обычный сокет
+    using connect_fun = std::function<bufferevent*(const origin&)>;
+
+    struct counters
+    {
+        std::size_t connections{};
+        std::size_t idle{};
+        std::size_t waiting{};
+        std::uint64_t created{};
+        std::uint64_t reused{};
+    };
+
+private:
+    struct host;
+    struct slot;
+
+    // запрос в ожидании или в работе
+    struct call final
+    {
+        client_pool& pool;
+        host& target;
+        slot* conn{};
+        request req{};
+        evhttp_cmd_type type{EVHTTP_REQ_GET};
+        std::string uri{};
+        request_fun fn{};
+        request_err_fun err{};
+        evhttp_request_error error{EVREQ_HTTP_EOF};
+    };
+
+    struct slot final
+    {
+        connection conn{};
+        clock::time_point last{clock::now()};
+        std::unique_ptr<call> active{};
+        bool used{};
+    };
+
+    struct host final
+    {
+        origin from{};
+        std::string host_header{};
+        // адреса слотов стабильны
+        std::list<slot> slots{};
+        std::deque<std::unique_ptr<call>> waiting{};
+    };
+
+    queue_handle_type queue_{};
+    evdns_base* dns_{};
+    client_pool_options options_{};
+    connect_fun connect_{};
+    std::unordered_map<std::string, std::unique_ptr<host>> hosts_{};
+    stack_event sweep_{};
+    std::uint64_t created_{};
+    std::uint64_t reused_{};
+
+    static ev_uint16_t default_port(const std::string& scheme) noexcept
+    {
+        return (scheme == "https") ? 443 : 80;
+    }
+
+    static std::string key_of(const origin& to)
+    {
+        auto rc = to.scheme;
+        rc += "://";
+        rc += to.host;
+        rc += ':';
+        rc += std::to_string(to.port);
+        return rc;
+    }
+
+    host& find_host(origin to)
+    {
+        if (to.scheme.empty())
+            to.scheme = "http";
+        if (!to.port)
+            to.port = default_port(to.scheme);
+        if (to.host.empty())
+            throw std::invalid_argument("client_pool origin");
+        if ((to.scheme != "http") && !connect_)
+            throw std::invalid_argument("client_pool scheme");
+
+        auto key = key_of(to);
+        auto i = hosts_.find(key);
+        if (i != hosts_.end())
+            return *i->second;
+
+        auto h = std::make_unique<host>();
+        h->host_header = (to.host.find(':') != std::string::npos) ?
+            '[' + to.host + ']' : to.host;
+        if (to.port != default_port(to.scheme))
+            h->host_header += ':' + std::to_string(to.port);
+        h->from = std::move(to);
+
+        auto& rc = *h;
+        hosts_.emplace(std::move(key), std::move(h));
+        return rc;
+    }
+
+    // свободное соединение, последнее освободившееся
+    // держит сокет теплым, остальные доживают до idle_timeout
+    static slot* idle_slot(host& h) noexcept
+    {
+        slot* rc = nullptr;
+        for (auto& s : h.slots)
+        {
+            if (!s.active && (!rc || (rc->last < s.last)))
+                rc = &s;
+        }
+        return rc;
+    }
+
+    slot* new_slot(host& h)
+    {
+        if (h.slots.size() >= options_.max_connections)
+            return nullptr;
+
+        auto& from = h.from;
+        auto bev = connect_ ? connect_(from) : nullptr;
+        connection conn = bev ?
+            connection{queue_, dns_, bev, from.host.c_str(), from.port} :
+            connection{queue_, dns_, from.host, from.port};
+        if (options_.connect_timeout.count())
+            conn.set_connect_timeout(options_.connect_timeout);
+        if (options_.timeout.count())
+        {
+            auto tv = make_timeval(options_.timeout);
+            evhttp_connection_set_timeout_tv(conn, &tv);
+        }
+
+        h.slots.emplace_back();
+        h.slots.back().conn = std::move(conn);
+        ++created_;
+        return &h.slots.back();
+    }
+
+    static void error_cb(evhttp_request_error error, void* arg) noexcept
+    {
+        static_cast<call*>(arg)->error = error;
+    }
+
+    // при ошибке evhttp вызывает error_cb, затем cb с nullptr,
+    // а при неудачном подключении только cb с кодом ответа 0
+    static void done_cb(evhttp_request* req, void* arg) noexcept
+    {
+        auto c = static_cast<call*>(arg);
+        c->pool.finish(*c, req);
+    }
+
+    void finish(call& c, evhttp_request* req) noexcept
+    {
+        auto& h = c.target;
+        auto s = c.conn;
+        auto self = std::move(s->active);
+        s->last = clock::now();
+
+        try {
+            if (req && evhttp_request_get_response_code(req))
+            {
+                if (self->fn)
+                    self->fn(request_ref{req});
+            }
+            else if (self->err)
+                self->err(self->error);
+        }
+        catch (...)
+        {   }
+
+        pump(h);
+    }
+
+    void fail(std::unique_ptr<call> c, evhttp_request_error error) noexcept
+    {
+        try {
+            if (c->err)
+                c->err(error);
+        }
+        catch (...)
+        {   }
+    }
+
+    void dispatch(host& h, slot& s, std::unique_ptr<call> c) noexcept
+    {
+        if (s.used)
+            ++reused_;
+        s.used = true;
+
+        auto req = c->req.release();
+        auto headers = evhttp_request_get_output_headers(req);
+        if (!evhttp_find_header(headers, "Host"))
+            evhttp_add_header(headers, "Host", h.host_header.c_str());
+
+        // калбеки запроса принадлежат пулу, evhttp_request_new
+        // не дает поменять их иначе
+        req->cb = done_cb;
+        req->cb_arg = c.get();
+        evhttp_request_set_error_cb(req, error_cb);
+
+        auto type = c->type;
+        auto uri = c->uri.c_str();
+        auto self = c.get();
+        c->conn = &s;
+        s.active = std::move(c);
+        // ошибка подключения может завершить запрос прямо здесь,
+        // и слот уже занят следующим
+        if (evhttp_make_request(s.conn, req, type, uri) &&
+            (s.active.get() == self))
+            fail(std::move(s.active), EVREQ_HTTP_REQUEST_CANCEL);
+    }
+
+    void pump(host& h) noexcept
+    {
+        while (!h.waiting.empty())
+        {
+            slot* s = idle_slot(h);
+            try {
+                if (!s)
+                    s = new_slot(h);
+            }
+            catch (...)
+            {
+                s = nullptr;
+                // новое соединение не создать, а ждать нечего
+                if (h.slots.empty())
+                {
+                    auto c = std::move(h.waiting.front());
+                    h.waiting.pop_front();
+                    fail(std::move(c), EVREQ_HTTP_REQUEST_CANCEL);
+                    continue;
+                }
+            }
+
+            if (!s)
+                break;
+
+            auto c = std::move(h.waiting.front());
+            h.waiting.pop_front();
+            dispatch(h, *s, std::move(c));
+        }
+    }
+
+    // закрывает соединения, простоявшие idle_timeout
+    // таймер идет с периодом idle_timeout, поэтому соединение
+    // живет без запросов не дольше двух периодов
+    void evict() noexcept
+    {
+        auto now = clock::now();
+        for (auto i = hosts_.begin(); i != hosts_.end(); )
+        {
+            auto& h = *i->second;
+            h.slots.remove_if([&](const slot& s) {
+                return !s.active && (now - s.last >= options_.idle_timeout);
+            });
+
+            if (h.slots.empty() && h.waiting.empty())
+                i = hosts_.erase(i);
+            else
+                ++i;
+        }
+    }
+
+    static void sweep_cb(evutil_socket_t, short, void* arg) noexcept
+    {
+        static_cast<client_pool*>(arg)->evict();
+    }
+
+    void submit(host& h, std::unique_ptr<call> c)
+    {
+        if (options_.max_waiting && (h.waiting.size() >= options_.max_waiting))
+            throw std::runtime_error("client_pool queue full");
+
+        h.waiting.push_back(std::move(c));
+        pump(h);
+    }
+
+public:
+    explicit client_pool(queue_handle_type queue, evdns_base* dns = nullptr,
+        const client_pool_options& options = {}, connect_fun connect = {})
+        : queue_{queue}
+        , dns_{dns}
+        , options_{options}
+        , connect_{std::move(connect)}
+    {
+        assert(queue);
+        if (!options_.max_connections)
+            throw std::invalid_argument("client_pool_options");
+
+        if (options_.idle_timeout.count())
+        {
+            sweep_.create(queue, -1, ev_timeout|ev_persist, sweep_cb, this);
+            auto tv = make_timeval(options_.idle_timeout);
+            e4pp::detail::check_result("event_add",
+                event_add(sweep_, &tv));
+        }
+    }
+
+    client_pool(const client_pool&) = delete;
+    client_pool& operator=(const client_pool&) = delete;
+
+    // запросы в работе и в ожидании отменяются без калбеков
+    ~client_pool() = default;
+
+    // запрос с пустым калбеком, калбеки назначает пул
+    static request create_request()
+    {
+        return request{+[](evhttp_request*, void*){}, nullptr};
+    }
+
+    // fn получает ответ, err - причину, если ответа нет
+    // uri - путь запроса, Host добавляется если не задан
+    void make_request(const origin& to, request req, evhttp_cmd_type type,
+        std::string uri, request_fun fn, request_err_fun err = {})
+    {
+        assert(req);
+
+        auto& h = find_host(to);
+        submit(h, std::unique_ptr<call>{new call{*this, h, nullptr,
+            std::move(req), type, std::move(uri), std::move(fn),
+            std::move(err)}});
+    }
+
+    // url - полный адрес scheme://host[:port]/path?query
+    void make_request(const std::string& url, request req,
+        evhttp_cmd_type type, request_fun fn, request_err_fun err = {})
+    {
+        e4pp::uri u{url};
+        origin to{std::string{u.scheme()}, std::string{u.host()},
+            static_cast<ev_uint16_t>((std::max)(u.port(), 0))};
+        auto path = u.full_path();
+        if (path.empty())
+            path = "/";
+        make_request(to, std::move(req), type, std::move(path),
+            std::move(fn), std::move(err));
+    }
+
+    // открывает соединения до count заранее
+    // evhttp подключается только под запрос, поэтому каждое новое
+    // соединение отправляет HEAD uri и остается в пуле
+    void warm(const origin& to, std::size_t count, std::string uri = "/")
+    {
+        auto& h = find_host(to);
+        while (h.slots.size() < count)
+        {
+            auto s = new_slot(h);
+            if (!s)
+                break;
+
+            dispatch(h, *s, std::unique_ptr<call>{new call{*this, h,
+                nullptr, create_request(), EVHTTP_REQ_HEAD, uri}});
+        }
+    }
+
+    counters stats() const noexcept
+    {
+        counters rc;
+        rc.created = created_;
+        rc.reused = reused_;
+        for (auto& i : hosts_)
+        {
+            auto& h = *i.second;
+            rc.connections += h.slots.size();
+            rc.waiting += h.waiting.size();
+            for (auto& s : h.slots)
+                rc.idle += !s.active;
+        }
+        return rc;
+    }
+};
+
+} // namespace http
+} // namespace e4pp
@@ -0,0 +1,408 @@
+#pragma once
+
+#include "e4pp/vhost.hpp"
+#include "e4pp/http/router.hpp"
+#include "e4pp/http/request.hpp"
+#include <event2/keyvalq_struct.h>
+#include <list>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <memory>
+#include <optional>
+#include <functional>
+#include <unordered_map>
+
+namespace e4pp {
+namespace http {
+
+struct response_cache_options
+{
+    // сколько ответ считается свежим
+    std::chrono::milliseconds ttl{5000};
+    // предел размера тел, заголовков и ключей
+    std::size_t max_bytes{64 * 1024 * 1024};
+    std::size_t max_entries{65536};
+    // заголовки запроса, различающие ответы (как Vary в ответе)
+    std::vector<std::string> vary{};
+};
+
+// ответ обработчика для кэша
+// тело неизменяемое и общее для всех копий ответа
+struct cached_response
+{
+    int code{HTTP_OK};
+    std::string reason{"OK"};
+    std::vector<std::pair<std::string, std::string>> headers{};
+    std::shared_ptr<const std::string> body{};
+    // 0 - ответить, но не хранить
+    // по умолчанию options.ttl для 200, остальные не хранятся
+    std::optional<std::chrono::milliseconds> ttl{};
+};
+
+// кэш ответов перед обработчиками сервера
+// ключ - метод, uri запроса и значения заголовков из vary
+// свежий ответ отдается без вызова обработчика, тело добавляется
+// в evbuffer ответа через evbuffer_add_reference без копирования
+// на промахе обработчик вызывается один раз на ключ: запросы,
+// пришедшие пока он работает, ждут и получают тот же ответ
+// вытеснение по ttl и LRU по размеру и числу записей
+// кэшируются только GET и HEAD, остальные методы идут в обработчик
+// каждый раз и получают его ответ без хранения и объединения
+// работает в одной очереди, объект не должен перемещаться
+class response_cache final
+{
+public:
+    using clock = std::chrono::steady_clock;
+    using respond_fun = std::function<void(cached_response)>;
+    // обработчик не отвечает на req сам, а вызывает respond,
+    // можно позже из той же очереди; кэш должен пережить вызов
+    using fill_fun = std::function<void(request_ref req,
+        respond_fun respond)>;
+    using route_fill_fun = std::function<void(request_ref req,
+        const route_params& params, respond_fun respond)>;
+
+    struct counters
+    {
+        std::uint64_t hits{};
+        std::uint64_t misses{};
+        std::uint64_t coalesced{};
+        std::size_t entries{};
+        std::size_t bytes{};
+    };
+
+private:
+    using body_ptr = std::shared_ptr<const std::string>;
+
+    struct entry final
+    {
+        std::string key{};
+        std::shared_ptr<const cached_response> response{};
+        clock::time_point expires{};
+        std::size_t size{};
+    };
+    using lru_list = std::list<entry>;
+
+    // запросы, ждущие ответа обработчика
+    struct flight final
+    {
+        std::vector<evhttp_request*> waiters{};
+    };
+
+    // маршрут attach
+    struct binding final
+    {
+        response_cache* self{};
+        fill_fun fill{};
+    };
+
+    response_cache_options options_{};
+    lru_list lru_{};
+    std::unordered_map<std::string_view, lru_list::iterator> index_{};
+    std::unordered_map<std::string, flight> inflight_{};
+    std::list<binding> attached_{};
+    std::size_t bytes_{};
+    std::uint64_t hits_{};
+    std::uint64_t misses_{};
+    std::uint64_t coalesced_{};
+
+    std::string key_of(evhttp_request* req) const
+    {
+        std::string rc = std::to_string(
+            static_cast<int>(evhttp_request_get_command(req)));
+        rc += ' ';
+        rc += evhttp_request_get_uri(req);
+
+        auto headers = evhttp_request_get_input_headers(req);
+        for (auto& name : options_.vary)
+        {
+            auto value = evhttp_find_header(headers, name.c_str());
+            rc += value ? '\0' : '\1';
+            if (value)
+                rc += value;
+        }
+        return rc;
+    }
+
+    static std::size_t size_of(const std::string& key,
+        const cached_response& res) noexcept
+    {
+        auto rc = key.size() + res.reason.size();
+        for (auto& h : res.headers)
+            rc += h.first.size() + h.second.size();
+        if (res.body)
+            rc += res.body->size();
+        return rc;
+    }
+
+    void erase(lru_list::iterator i) noexcept
+    {
+        bytes_ -= i->size;
+        index_.erase(i->key);
+        lru_.erase(i);
+    }
+
+    // свежая запись поднимается в начало LRU
+    std::shared_ptr<const cached_response> find(const std::string& key)
+    {
+        auto i = index_.find(key);
+        if (i == index_.end())
+            return nullptr;
+
+        auto e = i->second;
+        if (e->expires <= clock::now())
+        {
+            erase(e);
+            return nullptr;
+        }
+
+        lru_.splice(lru_.begin(), lru_, e);
+        return e->response;
+    }
+
+    void store(const std::string& key,
+        std::shared_ptr<const cached_response> res,
+        std::chrono::milliseconds ttl)
+    {
+        auto size = size_of(key, *res);
+        if (!ttl.count() || (size > options_.max_bytes))
+            return;
+
+        auto i = index_.find(key);
+        if (i != index_.end())
+            erase(i->second);
+
+        while (!lru_.empty() && ((bytes_ + size > options_.max_bytes) ||
+            (lru_.size() >= options_.max_entries)))
+            erase(std::prev(lru_.end()));
+
+        lru_.push_front(entry{key, std::move(res), clock::now() + ttl, size});
+        // ключ индекса указывает в строку записи
+        index_.emplace(lru_.front().key, lru_.begin());
+        bytes_ += size;
+    }
+
+    static void release_body(const void*, size_t, void* arg) noexcept
+    {
+        delete static_cast<body_ptr*>(arg);
+    }
+
+    // тело уходит ссылкой, запись кэша может быть вытеснена раньше,
+    // чем evbuffer его отправит - ссылка держит блок
+    static void reply(evhttp_request* req, const cached_response& res) noexcept
+    {
+        auto headers = evhttp_request_get_output_headers(req);
+        for (auto& h : res.headers)
+            evhttp_add_header(headers, h.first.c_str(), h.second.c_str());
+
+        auto& body = res.body;
+        if (body && !body->empty())
+        {
+            auto ref = new (std::nothrow) body_ptr{body};
+            if (!ref || evbuffer_add_reference(
+                evhttp_request_get_output_buffer(req), body->data(),
+                body->size(), release_body, ref))
+            {
+                delete ref;
+                evhttp_send_error(req, HTTP_INTERNAL, nullptr);
+                return;
+            }
+        }
+
+        evhttp_send_reply(req, res.code, res.reason.c_str(), nullptr);
+    }
+
+    void complete(const std::string& key, cached_response res) noexcept
+    {
+        auto i = inflight_.find(key);
+        if (i == inflight_.end())
+            return;
+
+        auto waiters = std::move(i->second.waiters);
+        inflight_.erase(i);
+
+        auto ttl = res.ttl ? *res.ttl : ((res.code == HTTP_OK) ?
+            options_.ttl : std::chrono::milliseconds{});
+        std::shared_ptr<const cached_response> shared;
+        try {
+            shared = std::make_shared<const cached_response>(std::move(res));
+            store(key, shared, ttl);
+        }
+        catch (...)
+        {
+            if (!shared)
+            {
+                for (auto req : waiters)
+                    evhttp_send_error(req, HTTP_INTERNAL, nullptr);
+                return;
+            }
+        }
+
+        for (auto req : waiters)
+            reply(req, *shared);
+    }
+
+    void fail(const std::string& key) noexcept
+    {
+        auto i = inflight_.find(key);
+        if (i == inflight_.end())
+            return;
+
+        auto waiters = std::move(i->second.waiters);
+        inflight_.erase(i);
+        for (auto req : waiters)
+            evhttp_send_error(req, HTTP_INTERNAL, nullptr);
+    }
+
+    static bool cacheable(evhttp_request* req) noexcept
+    {
+        auto type = evhttp_request_get_command(req);
+        return (type == EVHTTP_REQ_GET) || (type == EVHTTP_REQ_HEAD);
+    }
+
+    // ответ обработчика сразу клиенту, мимо кэша
+    // после ответа req может быть уже освобожден evhttp
+    template<class F>
+    void bypass(evhttp_request* req, F&& call)
+    {
+        auto pending = std::make_shared<evhttp_request*>(req);
+        try {
+            call(respond_fun{[pending](cached_response res) {
+                auto r = std::exchange(*pending, nullptr);
+                if (r)
+                    reply(r, res);
+            }});
+        }
+        catch (...)
+        {
+            // respond мог быть вызван до исключения
+            auto r = std::exchange(*pending, nullptr);
+            if (r)
+                evhttp_send_error(r, HTTP_INTERNAL, nullptr);
+        }
+    }
+
+    template<class F>
+    void run(evhttp_request* req, F&& call)
+    {
+        assert(req);
+
+        if (!cacheable(req))
+        {
+            bypass(req, std::forward<F>(call));
+            return;
+        }
+
+        auto key = key_of(req);
+        auto cached = find(key);
+        if (cached)
+        {
+            ++hits_;
+            reply(req, *cached);
+            return;
+        }
+
+        auto i = inflight_.find(key);
+        if (i != inflight_.end())
+        {
+            ++coalesced_;
+            i->second.waiters.push_back(req);
+            return;
+        }
+
+        ++misses_;
+        inflight_[key].waiters.push_back(req);
+        try {
+            call(respond_fun{[this, key](cached_response res) {
+                complete(key, std::move(res));
+            }});
+        }
+        catch (...)
+        {
+            // respond мог быть вызван до исключения
+            fail(key);
+        }
+    }
+
+    static void attached_cb(evhttp_request* req, void* arg) noexcept
+    {
+        auto b = static_cast<binding*>(arg);
+        try {
+            b->self->serve(request_ref{req}, b->fill);
+        }
+        catch (...)
+        {   }
+    }
+
+public:
+    explicit response_cache(const response_cache_options& options = {})
+        : options_{options}
+    {
+        if (!options_.max_entries)
+            throw std::invalid_argument("response_cache_options");
+    }
+
+    response_cache(const response_cache&) = delete;
+    response_cache& operator=(const response_cache&) = delete;
+
+    // ответ из кэша или через fill
+    void serve(request_ref req, const fill_fun& fill)
+    {
+        assert(fill);
+        run(req, [&](respond_fun respond) {
+            fill(req, std::move(respond));
+        });
+    }
+
+    // обработчик для router
+    route_fun route(route_fill_fun fill)
+    {
+        assert(fill);
+        return [this, fill = std::move(fill)](request_ref req,
+            const route_params& params) {
+            run(req, [&](respond_fun respond) {
+                fill(req, params, std::move(respond));
+            });
+        };
+    }
+
+    // маршрут evhttp_set_cb на сервере или виртуальном хосте
+    void attach(vhost& host, const char* path, fill_fun fill)
+    {
+        assert(path && fill);
+        attached_.push_back(binding{this, std::move(fill)});
+        auto rc = evhttp_set_cb(host, path, attached_cb, &attached_.back());
+        if (rc)
+            attached_.pop_back();
+        e4pp::detail::check_result("evhttp_set_cb", rc);
+    }
+
+    // удалить ответ по ключу запроса
+    void invalidate(request_ref req)
+    {
+        auto i = index_.find(key_of(req));
+        if (i != index_.end())
+            erase(i->second);
+    }
+
+    void clear() noexcept
+    {
+        lru_.clear();
+        index_.clear();
+        bytes_ = 0;
+    }
+
+    counters stats() const noexcept
+    {
+        counters rc;
+        rc.hits = hits_;
+        rc.misses = misses_;
+        rc.coalesced = coalesced_;
+        rc.entries = lru_.size();
+        rc.bytes = bytes_;
+        return rc;
+    }
+};
+
+} // namespace http
+} // namespace e4pp
@@ -0,0 +1,417 @@
+#pragma once
+
+#include "e4pp/vhost.hpp"
+#include "e4pp/http/request.hpp"
+#include <array>
+#include <bit>
+#include <string>
+#include <vector>
+#include <memory>
+#include <optional>
+#include <charconv>
+#include <functional>
+#include <string_view>
+#include <type_traits>
+
+namespace e4pp {
+namespace http {
+
+// значения {name} и *name совпавшего маршрута
+// string_view указывают в путь запроса (без декодирования %xx)
+// и действительны пока жив запрос
+class route_params final
+{
+public:
+    struct value
+    {
+        std::string_view name{};
+        std::string_view text{};
+    };
+
+private:
+    std::vector<value> values_{};
+
+    friend class router;
+
+public:
+    std::size_t size() const noexcept
+    {
+        return values_.size();
+    }
+
+    bool empty() const noexcept
+    {
+        return values_.empty();
+    }
+
+    auto begin() const noexcept
+    {
+        return values_.begin();
+    }
+
+    auto end() const noexcept
+    {
+        return values_.end();
+    }
+
+    // пустая строка если параметра нет
+    std::string_view get(std::string_view name) const noexcept
+    {
+        for (auto& v : values_)
+        {
+            if (v.name == name)
+                return v.text;
+        }
+        return {};
+    }
+
+    std::string_view operator[](std::string_view name) const noexcept
+    {
+        return get(name);
+    }
+
+    // число из параметра, пусто если его нет или он не число целиком
+    template<class T>
+    std::optional<T> as(std::string_view name) const noexcept
+    {
+        static_assert(std::is_arithmetic<T>::value);
+
+        auto text = get(name);
+        T rc{};
+        auto end = text.data() + text.size();
+        auto r = std::from_chars(text.data(), end, rc);
+        if (text.empty() || (r.ec != std::errc{}) || (r.ptr != end))
+            return std::nullopt;
+        return rc;
+    }
+};
+
+using route_fun = std::function<void(request_ref req,
+    const route_params& params)>;
+
+// маршрутизатор запросов на сжатом префиксном дереве
+// шаблон: статические части, {name} - один сегмент пути целиком,
+// *name - остаток пути, только в конце
+// поиск идет по символам пути один раз, при равных вариантах
+// статика важнее {name}, {name} важнее *name; возврат к
+// следующему варианту бывает только когда статическая ветка
+// не довела до маршрута
+// устанавливается через evhttp_set_gencb: маршруты evhttp_set_cb
+// проверяются evhttp раньше, их можно не переносить сразу
+// объект передает this в evhttp и не должен перемещаться
+class router final
+{
+    // индексы по номерам битов evhttp_cmd_type
+    static constexpr std::size_t method_count = 9;
+    using handlers = std::array<route_fun, method_count>;
+
+    struct node final
+    {
+        // статическая часть, для {name} и *name пустая
+        std::string prefix{};
+        // первые символы prefix у children
+        std::string indices{};
+        std::vector<std::unique_ptr<node>> children{};
+        std::unique_ptr<node> param{};
+        std::unique_ptr<node> wildcard{};
+        // имя у узлов {name} и *name
+        std::string name{};
+        std::unique_ptr<handlers> leaf{};
+    };
+
+    node root_{};
+    route_params params_{};
+    std::size_t depth_{};
+    request_fun fallback_{};
+
+    static std::size_t method_index(evhttp_cmd_type type) noexcept
+    {
+        return static_cast<std::size_t>(
+            std::countr_zero(static_cast<unsigned>(type)));
+    }
+
+    static std::size_t common_prefix(std::string_view a,
+        std::string_view b) noexcept
+    {
+        std::size_t i = 0;
+        auto n = (std::min)(a.size(), b.size());
+        while ((i < n) && (a[i] == b[i]))
+            ++i;
+        return i;
+    }
+
+    // вставка статической части с расщеплением узлов
+    static node& insert_static(node& n, std::string_view text)
+    {
+        auto at = &n;
+        while (!text.empty())
+        {
+            auto i = at->indices.find(text[0]);
+            if (i == std::string::npos)
+            {
+                auto child = std::make_unique<node>();
+                child->prefix = text;
+                at->indices += text[0];
+                at->children.push_back(std::move(child));
+                return *at->children.back();
+            }
+
+            auto& child = at->children[i];
+            auto len = common_prefix(child->prefix, text);
+            if (len < child->prefix.size())
+            {
+                auto mid = std::make_unique<node>();
+                mid->prefix = child->prefix.substr(0, len);
+                child->prefix.erase(0, len);
+                mid->indices += child->prefix[0];
+                mid->children.push_back(std::move(child));
+                child = std::move(mid);
+            }
+
+            at = child.get();
+            text.remove_prefix(len);
+        }
+        return *at;
+    }
+
+    static node& insert_capture(std::unique_ptr<node>& slot,
+        std::string_view name)
+    {
+        if (name.empty())
+            throw std::invalid_argument("router: empty parameter name");
+
+        if (!slot)
+        {
+            slot = std::make_unique<node>();
+            slot->name = name;
+        }
+        else if (slot->name != name)
+            throw std::invalid_argument("router: parameter name conflict");
+        return *slot;
+    }
+
+    static node& insert(node& root, std::string_view pattern)
+    {
+        if (pattern.empty() || (pattern[0] != '/'))
+            throw std::invalid_argument("router: pattern must start with /");
+
+        auto at = &root;
+        while (!pattern.empty())
+        {
+            auto c = pattern[0];
+            if (c == '{')
+            {
+                auto close = pattern.find('}');
+                if (close == std::string_view::npos)
+                    throw std::invalid_argument("router: unclosed {");
+                auto name = pattern.substr(1, close - 1);
+                pattern.remove_prefix(close + 1);
+                if (!pattern.empty() && (pattern[0] != '/'))
+                    throw std::invalid_argument("router: {} must be a segment");
+                at = &insert_capture(at->param, name);
+                continue;
+            }
+
+            if (c == '*')
+            {
+                auto name = pattern.substr(1);
+                if (name.find('/') != std::string_view::npos)
+                    throw std::invalid_argument("router: * must be last");
+                at = &insert_capture(at->wildcard, name);
+                break;
+            }
+
+            // статика до начала следующего сегмента с захватом
+            auto end = pattern.find_first_of("{*");
+            if ((end != std::string_view::npos) && (pattern[end - 1] != '/'))
+                throw std::invalid_argument("router: capture must be a segment");
+            at = &insert_static(*at, pattern.substr(0, end));
+            pattern.remove_prefix((end == std::string_view::npos) ?
+                pattern.size() : end);
+        }
+        return *at;
+    }
+
+    // n уже совпал, path - непроверенный остаток
+    const handlers* match(const node& n, std::string_view path)
+    {
+        if (path.empty() && n.leaf)
+            return n.leaf.get();
+
+        if (!path.empty())
+        {
+            auto i = n.indices.find(path[0]);
+            if (i != std::string::npos)
+            {
+                auto& child = *n.children[i];
+                if (path.starts_with(child.prefix))
+                {
+                    auto rc = match(child, path.substr(child.prefix.size()));
+                    if (rc)
+                        return rc;
+                }
+            }
+
+            if (n.param)
+            {
+                auto seg = path.substr(0, path.find('/'));
+                if (!seg.empty())
+                {
+                    params_.values_.push_back({n.param->name, seg});
+                    auto rc = match(*n.param, path.substr(seg.size()));
+                    if (rc)
+                        return rc;
+                    params_.values_.pop_back();
+                }
+            }
+        }
+
+        // *name совпадает и с пустым остатком
+        if (n.wildcard && n.wildcard->leaf)
+        {
+            params_.values_.push_back({n.wildcard->name, path});
+            return n.wildcard->leaf.get();
+        }
+        return nullptr;
+    }
+
+    // HEAD без своего обработчика обслуживает GET
+    static const route_fun* select(const handlers& h,
+        evhttp_cmd_type type) noexcept
+    {
+        auto i = method_index(type);
+        if ((i < method_count) && h[i])
+            return &h[i];
+
+        auto get = method_index(EVHTTP_REQ_GET);
+        if ((type == EVHTTP_REQ_HEAD) && h[get])
+            return &h[get];
+        return nullptr;
+    }
+
+    static std::string_view path_of(evhttp_request* req) noexcept
+    {
+        auto uri = evhttp_request_get_evhttp_uri(req);
+        auto path = uri ? evhttp_uri_get_path(uri) : nullptr;
+        return (path && *path) ? std::string_view{path} : "/";
+    }
+
+    static const char* method_name(std::size_t index) noexcept
+    {
+        static constexpr const char* names[method_count] = {"GET", "POST",
+            "HEAD", "PUT", "DELETE", "OPTIONS", "TRACE", "CONNECT", "PATCH"};
+        return names[index];
+    }
+
+    static void method_not_allowed(evhttp_request* req, const handlers& h)
+    {
+        std::string allow;
+        for (std::size_t i = 0; i < method_count; ++i)
+        {
+            if (!h[i])
+                continue;
+            if (!allow.empty())
+                allow += ", ";
+            allow += method_name(i);
+        }
+        // evhttp_send_error сбрасывает заголовки ответа
+        evhttp_add_header(evhttp_request_get_output_headers(req),
+            "Allow", allow.c_str());
+        evhttp_send_reply(req, 405, "Method Not Allowed", nullptr);
+    }
+
+    static void gencb(evhttp_request* req, void* arg) noexcept
+    {
+        // ответ на запрос - забота обработчика, и при исключении тоже
+        try {
+            static_cast<router*>(arg)->dispatch(req);
+        }
+        catch (...)
+        {   }
+    }
+
+public:
+    router() = default;
+    router(const router&) = delete;
+    router& operator=(const router&) = delete;
+
+    // methods - набор method::get|method::post...,
+    // повторная регистрация заменяет обработчик
+    void add(cmd_type methods, std::string_view pattern, route_fun fn)
+    {
+        assert(fn);
+
+        auto& n = insert(root_, pattern);
+        if (!n.leaf)
+            n.leaf = std::make_unique<handlers>();
+
+        auto mask = static_cast<unsigned>(static_cast<int>(methods));
+        for (std::size_t i = 0; i < method_count; ++i)
+        {
+            if (mask & (1u << i))
+                (*n.leaf)[i] = fn;
+        }
+
+        std::size_t captures = 0;
+        for (auto c : pattern)
+            captures += (c == '{') || (c == '*');
+        if (depth_ < captures)
+        {
+            depth_ = captures;
+            params_.values_.reserve(depth_);
+        }
+    }
+
+    // без маршрута: fn или 404
+    void set_fallback(request_fun fn)
+    {
+        fallback_ = std::move(fn);
+    }
+
+    // обработчик для метода и пути, params заполняются захватами
+    // @return nullptr если путь не найден или метод не разрешен
+    const route_fun* find(evhttp_cmd_type type, std::string_view path,
+        const route_params*& params)
+    {
+        params_.values_.clear();
+        params = &params_;
+        auto h = match(root_, path);
+        return h ? select(*h, type) : nullptr;
+    }
+
+    // 405 с Allow если путь есть, но метода нет
+    void dispatch(evhttp_request* req)
+    {
+        assert(req);
+
+        params_.values_.clear();
+        auto h = match(root_, path_of(req));
+        if (!h)
+        {
+            if (fallback_)
+                fallback_(request_ref{req});
+            else
+                evhttp_send_error(req, HTTP_NOTFOUND, nullptr);
+            return;
+        }
+
+        auto fn = select(*h, evhttp_request_get_command(req));
+        if (!fn)
+        {
+            method_not_allowed(req, *h);
+            return;
+        }
+
+        (*fn)(request_ref{req}, params_);
+    }
+
+    // evhttp_set_gencb на сервере или виртуальном хосте,
+    // router должен пережить host
+    void attach(vhost& host) noexcept
+    {
+        evhttp_set_gencb(host, gencb, this);
+    }
+};
+
+} // namespace http
+} // namespace e4pp
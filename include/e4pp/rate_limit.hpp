@@ -0,0 +1,189 @@
+#pragma once
+
+#include "e4pp/buffer_event.hpp"
+
+namespace e4pp {
+
+using token_bucket_handle_type = ev_token_bucket_cfg*;
+using rate_limit_group_handle_type = bufferevent_rate_limit_group*;
+
+// конфигурация token bucket
+// libevent не копирует ее в bufferevent_set_rate_limit,
+// поэтому объект должен жить пока им пользуется хоть один bufferevent
+class token_bucket final
+{
+public:
+    using handle_type = token_bucket_handle_type;
+
+    static constexpr std::size_t unlimited = EV_RATE_LIMIT_MAX;
+
+private:
+    struct free_token_bucket
+    {
+        void operator()(handle_type ptr) noexcept
+        {
+            ev_token_bucket_cfg_free(ptr);
+        }
+    };
+    using ptr_type = std::unique_ptr<ev_token_bucket_cfg, free_token_bucket>;
+    ptr_type handle_{};
+
+public:
+    token_bucket() = default;
+    token_bucket(token_bucket&&) = default;
+    token_bucket& operator=(token_bucket&&) = default;
+
+    // rate - байт за тик, burst - максимальный размер корзины
+    // тик по умолчанию одна секунда
+    token_bucket(std::size_t read_rate, std::size_t read_burst,
+        std::size_t write_rate, std::size_t write_burst)
+        : handle_{detail::check_pointer("ev_token_bucket_cfg_new",
+            ev_token_bucket_cfg_new(read_rate, read_burst,
+                write_rate, write_burst, nullptr))}
+    {   }
+
+    template<class Rep, class Period>
+    token_bucket(std::size_t read_rate, std::size_t read_burst,
+        std::size_t write_rate, std::size_t write_burst,
+        std::chrono::duration<Rep, Period> tick)
+    {
+        auto tv = make_timeval(tick);
+        handle_.reset(detail::check_pointer("ev_token_bucket_cfg_new",
+            ev_token_bucket_cfg_new(read_rate, read_burst,
+                write_rate, write_burst, &tv)));
+    }
+
+    handle_type handle() const noexcept
+    {
+        return handle_.get();
+    }
+
+    operator handle_type() const noexcept
+    {
+        return handle();
+    }
+
+    bool empty() const noexcept
+    {
+        return nullptr == handle();
+    }
+};
+
+// общий лимит на группу bufferevent
+// bufferevent сам выходит из группы при освобождении,
+// группа должна быть разрушена после всех своих участников
+class rate_limit_group final
+{
+public:
+    using handle_type = rate_limit_group_handle_type;
+
+private:
+    struct free_rate_limit_group
+    {
+        void operator()(handle_type ptr) noexcept
+        {
+            bufferevent_rate_limit_group_free(ptr);
+        }
+    };
+    using ptr_type = std::unique_ptr<bufferevent_rate_limit_group,
+        free_rate_limit_group>;
+    ptr_type handle_{};
+
+public:
+    rate_limit_group() = default;
+    rate_limit_group(rate_limit_group&&) = default;
+    rate_limit_group& operator=(rate_limit_group&&) = default;
+
+    // конфигурация копируется, token_bucket можно освободить
+    rate_limit_group(queue_handle_type queue, const token_bucket& cfg)
+        : handle_{detail::check_pointer("bufferevent_rate_limit_group_new",
+            bufferevent_rate_limit_group_new(assert_handle(queue), cfg))}
+    {   }
+
+    handle_type handle() const noexcept
+    {
+        return handle_.get();
+    }
+
+    operator handle_type() const noexcept
+    {
+        return handle();
+    }
+
+    bool empty() const noexcept
+    {
+        return nullptr == handle();
+    }
+
+    void set(const token_bucket& cfg)
+    {
+        detail::check_result("bufferevent_rate_limit_group_set_cfg",
+            bufferevent_rate_limit_group_set_cfg(
+                assert_handle(handle()), cfg));
+    }
+
+    // минимальная порция которую группа выделяет одному bufferevent
+    void set_min_share(std::size_t size)
+    {
+        detail::check_result("bufferevent_rate_limit_group_set_min_share",
+            bufferevent_rate_limit_group_set_min_share(
+                assert_handle(handle()), size));
+    }
+
+    // bufferevent может состоять только в одной группе
+    void add(const detail::buffer_event_base& bev)
+    {
+        detail::check_result("bufferevent_add_to_rate_limit_group",
+            bufferevent_add_to_rate_limit_group(bev.handle(),
+                assert_handle(handle())));
+    }
+
+    void remove(const detail::buffer_event_base& bev)
+    {
+        detail::check_result("bufferevent_remove_from_rate_limit_group",
+            bufferevent_remove_from_rate_limit_group(bev.handle()));
+    }
+
+    ev_ssize_t read_limit() const noexcept
+    {
+        return bufferevent_rate_limit_group_get_read_limit(
+            assert_handle(handle()));
+    }
+
+    ev_ssize_t write_limit() const noexcept
+    {
+        return bufferevent_rate_limit_group_get_write_limit(
+            assert_handle(handle()));
+    }
+
+    void decrement_read(ev_ssize_t size)
+    {
+        detail::check_result("bufferevent_rate_limit_group_decrement_read",
+            bufferevent_rate_limit_group_decrement_read(
+                assert_handle(handle()), size));
+    }
+
+    void decrement_write(ev_ssize_t size)
+    {
+        detail::check_result("bufferevent_rate_limit_group_decrement_write",
+            bufferevent_rate_limit_group_decrement_write(
+                assert_handle(handle()), size));
+    }
+
+    // всего прочитано и записано участниками группы
+    std::pair<ev_uint64_t, ev_uint64_t> totals() const noexcept
+    {
+        ev_uint64_t total_read{};
+        ev_uint64_t total_written{};
+        bufferevent_rate_limit_group_get_totals(assert_handle(handle()),
+            &total_read, &total_written);
+        return {total_read, total_written};
+    }
+
+    void reset_totals() noexcept
+    {
+        bufferevent_rate_limit_group_reset_totals(assert_handle(handle()));
+    }
+};
+
+} // namespace e4pp
@@ -0,0 +1,174 @@
+#pragma once
+
+#include "e4pp/buffer_event.hpp"
+#include "e4pp/evtype.hpp"
+#include <chrono>
+#include <functional>
+
+namespace e4pp {
+
+struct idle_reclaim_options
+{
+    // простой, после которого освобождается память
+    std::chrono::milliseconds idle{30000};
+    // остаток input не больше repack переносится в плотную цепочку
+    // 0 - не трогать
+    std::size_t repack{2048};
+};
+
+// освобождение памяти простаивающего соединения
+// активность - данные, добавленные или удаленные из буферов bufferevent
+// после idle без активности сжимается input и вызывается
+// release(true), при первой активности после этого - release(false)
+// таймер не перезапускается на каждую активность: срабатывает
+// не чаще раза в idle и досчитывает остаток простоя
+// объект передает this в калбеки буферов и таймера и не должен
+// перемещаться, bufferevent должен пережить объект
+class idle_reclaim final
+{
+public:
+    using clock = std::chrono::steady_clock;
+    // idle - соединение простаивает, вернуть оценку освобожденных байт
+    // !idle - активность возобновилась
+    using release_fun = std::function<std::size_t(bool idle)>;
+
+private:
+    buffer_event_ptr bev_{};
+    idle_reclaim_options options_{};
+    release_fun release_{};
+    evbuffer_cb_entry* input_cb_{};
+    evbuffer_cb_entry* output_cb_{};
+    stack_event timer_{};
+    clock::time_point last_{clock::now()};
+    std::size_t reclaimed_{};
+    // input пополнялся после прошлого сжатия
+    bool input_added_{};
+    bool idle_{};
+    // сжатие input само вызывает калбек буфера
+    bool releasing_{};
+
+    void arm(clock::duration timeout)
+    {
+        auto tv = make_timeval(timeout);
+        detail::check_result("event_add", event_add(timer_, &tv));
+    }
+
+    void wake() noexcept
+    {
+        idle_ = false;
+        if (release_)
+        {
+            try {
+                release_(false);
+            }
+            catch (...)
+            {   }
+        }
+
+        try {
+            arm(options_.idle);
+        }
+        catch (...)
+        {   }
+    }
+
+    static void buffer_cb(evbuffer* buf, const evbuffer_cb_info* info,
+        void* arg) noexcept
+    {
+        auto self = static_cast<idle_reclaim*>(arg);
+        if (self->releasing_ || !(info->n_added || info->n_deleted))
+            return;
+
+        self->last_ = clock::now();
+        if (info->n_added && (buf == bufferevent_get_input(self->bev_)))
+            self->input_added_ = true;
+        if (self->idle_)
+            self->wake();
+    }
+
+    static void timer_cb(evutil_socket_t, short, void* arg) noexcept
+    {
+        auto self = static_cast<idle_reclaim*>(arg);
+        auto quiet = clock::now() - self->last_;
+        if (quiet < self->options_.idle)
+        {
+            try {
+                self->arm(self->options_.idle - quiet);
+            }
+            catch (...)
+            {   }
+            return;
+        }
+
+        self->reclaim();
+    }
+
+public:
+    idle_reclaim(buffer_event_ptr bev,
+        const idle_reclaim_options& options = {}, release_fun release = {})
+        : bev_{bev}
+        , options_{options}
+        , release_{std::move(release)}
+    {
+        assert(bev);
+
+        timer_.create(bufferevent_get_base(bev), -1, ev_timeout,
+            timer_cb, this);
+        input_cb_ = detail::check_pointer("evbuffer_add_cb",
+            evbuffer_add_cb(bufferevent_get_input(bev), buffer_cb, this));
+        output_cb_ = evbuffer_add_cb(bufferevent_get_output(bev),
+            buffer_cb, this);
+        if (!output_cb_)
+        {
+            evbuffer_remove_cb_entry(bufferevent_get_input(bev), input_cb_);
+            throw std::runtime_error("evbuffer_add_cb failed");
+        }
+
+        arm(options_.idle);
+    }
+
+    idle_reclaim(const idle_reclaim&) = delete;
+    idle_reclaim& operator=(const idle_reclaim&) = delete;
+
+    ~idle_reclaim()
+    {
+        evbuffer_remove_cb_entry(bufferevent_get_input(bev_), input_cb_);
+        evbuffer_remove_cb_entry(bufferevent_get_output(bev_), output_cb_);
+    }
+
+    // освободить сейчас, не дожидаясь таймера
+    // @return оценка освобожденных байт
+    std::size_t reclaim() noexcept
+    {
+        std::size_t rc = 0;
+        releasing_ = true;
+        try {
+            if (input_added_ && options_.repack)
+                rc += detail::repack_input(bufferevent_get_input(bev_),
+                    options_.repack);
+            if (!idle_ && release_)
+                rc += release_(true);
+        }
+        catch (...)
+        {   }
+        releasing_ = false;
+
+        input_added_ = false;
+        idle_ = true;
+        reclaimed_ += rc;
+        return rc;
+    }
+
+    bool idle() const noexcept
+    {
+        return idle_;
+    }
+
+    // всего освобождено за время жизни, оценка
+    std::size_t reclaimed() const noexcept
+    {
+        return reclaimed_;
+    }
+};
+
+} // namespace e4pp
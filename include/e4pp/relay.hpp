@@ -0,0 +1,481 @@
+#pragma once
+
+#include "e4pp/ev.hpp"
+#include "e4pp/buffer_event.hpp"
+
+#include <functional>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#endif // _WIN32
+
+namespace e4pp {
+
+// двунаправленная пересылка между двумя buffer_event
+// медленная сторона останавливает чтение с другой стороны через
+// write watermark, на linux возможна пересылка через splice() без
+// копирования данных в userspace
+// объект передает this в калбеки и не должен перемещаться
+class relay final
+{
+public:
+    using done_fun = std::function<void(short what)>;
+
+    enum class mode
+    {
+        buffer,
+        splice
+    };
+
+    static constexpr std::size_t default_high_watermark = 256 * 1024;
+
+private:
+    struct direction final
+    {
+        relay& owner_;
+        buffer_event_ref from_{};
+        buffer_event_ref to_{};
+        std::uint64_t bytes_{};
+        bool paused_{};
+        bool eof_{};
+        bool done_{};
+
+#ifdef __linux__
+        int pipe_[2]{-1, -1};
+        std::size_t in_pipe_{};
+        // данные которые успели попасть в evbuffer до перехода на splice
+        buffer pending_{};
+        generic_fn<direction> read_fn_{&direction::on_splice_read, *this};
+        generic_fn<direction> write_fn_{&direction::on_splice_write, *this};
+        ev_stack read_ev_{};
+        ev_stack write_ev_{};
+#endif // __linux__
+
+        explicit direction(relay& owner) noexcept
+            : owner_{owner}
+        {   }
+
+        direction(const direction&) = delete;
+        direction& operator=(const direction&) = delete;
+
+        ~direction() noexcept
+        {
+#ifdef __linux__
+            close_pipe();
+#endif // __linux__
+        }
+
+        direction& other() noexcept
+        {
+            return owner_.other(*this);
+        }
+
+        void shutdown_write() noexcept
+        {
+            auto fd = to_.fd();
+            if (fd != -1)
+            {
+#ifdef _WIN32
+                ::shutdown(fd, SD_SEND);
+#else
+                ::shutdown(fd, SHUT_WR);
+#endif // _WIN32
+            }
+            done_ = true;
+        }
+
+        // --- buffer mode
+
+        void forward()
+        {
+            auto input = from_.input();
+            auto size = input.size();
+            if (size)
+            {
+                to_.output().append(input);
+                bytes_ += size;
+            }
+
+            if (!paused_ && (to_.output().size() >= owner_.high_))
+            {
+                // получатель не успевает, перестаем читать источник
+                from_.disable(EV_READ);
+                paused_ = true;
+            }
+        }
+
+        // выходной буфер получателя опустел до low watermark
+        void resume()
+        {
+            if (done_)
+                return;
+
+            auto pending = to_.output().size();
+            if (paused_ && !eof_ && (pending <= owner_.low_))
+            {
+                paused_ = false;
+                from_.enable(EV_READ);
+            }
+
+            if (eof_ && !pending)
+                shutdown_write();
+        }
+
+        void on_event(short what)
+        {
+            if (what & BEV_EVENT_EOF)
+            {
+                eof_ = true;
+                forward();
+                if (to_.output().empty())
+                    shutdown_write();
+            }
+            else if (what & (BEV_EVENT_ERROR|BEV_EVENT_TIMEOUT))
+                owner_.finish(what);
+        }
+
+        static void readcb(bufferevent*, void* arg) noexcept
+        {
+            assert(arg);
+            auto self = static_cast<direction*>(arg);
+            try {
+                self->forward();
+            }
+            catch (...)
+            {
+                self->owner_.finish(BEV_EVENT_ERROR);
+            }
+        }
+
+        static void writecb(bufferevent*, void* arg) noexcept
+        {
+            assert(arg);
+            auto self = static_cast<direction*>(arg);
+            try {
+                // это выходной буфер нашего источника
+                // значит продолжать нужно обратное направление
+                self->other().resume();
+                self->owner_.check_done();
+            }
+            catch (...)
+            {
+                self->owner_.finish(BEV_EVENT_ERROR);
+            }
+        }
+
+        static void eventcb(bufferevent*, short what, void* arg) noexcept
+        {
+            assert(arg);
+            auto self = static_cast<direction*>(arg);
+            try {
+                self->on_event(what);
+                self->owner_.check_done();
+            }
+            catch (...)
+            {
+                self->owner_.finish(BEV_EVENT_ERROR);
+            }
+        }
+
+        void start_buffer()
+        {
+            from_.set(readcb, writecb, eventcb, this);
+            from_.set_watermark(EV_WRITE, owner_.low_, 0);
+            from_.enable(EV_READ|EV_WRITE);
+        }
+
+#ifdef __linux__
+        // --- splice mode
+
+        void close_pipe() noexcept
+        {
+            for (auto& fd : pipe_)
+            {
+                if (fd != -1)
+                    ::close(std::exchange(fd, -1));
+            }
+        }
+
+        void start_splice()
+        {
+            if (::pipe2(pipe_, O_NONBLOCK|O_CLOEXEC) == -1)
+                throw std::runtime_error("pipe2");
+
+            // все что уже прочитано в evbuffer уходит первым
+            // вывод to_ уже учтен в режиме буферов
+            auto input = from_.input().size();
+            pending_.append(to_.output());
+            pending_.append(from_.input());
+            bytes_ += input;
+
+            auto queue = from_.queue();
+            read_ev_.create(queue, from_.fd(), ev_read|ev_persist, read_fn_);
+            write_ev_.create(queue, to_.fd(), ev_write|ev_persist, write_fn_);
+            read_ev_.add();
+            if (!pending_.empty())
+                write_ev_.add();
+        }
+
+        void stop_splice() noexcept
+        {
+            read_ev_.destroy();
+            write_ev_.destroy();
+        }
+
+        // @return true если все отправлено
+        bool flush_splice()
+        {
+            while (!pending_.empty())
+            {
+                if (pending_.write(to_.fd()) < 0)
+                {
+                    if (errno == EAGAIN)
+                        return false;
+                    throw std::runtime_error("evbuffer_write");
+                }
+            }
+
+            while (in_pipe_)
+            {
+                auto rc = ::splice(pipe_[0], nullptr, to_.fd(), nullptr,
+                    in_pipe_, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+                if (rc < 0)
+                {
+                    if (errno == EAGAIN)
+                        return false;
+                    throw std::runtime_error("splice");
+                }
+                in_pipe_ -= static_cast<std::size_t>(rc);
+            }
+
+            return true;
+        }
+
+        void update_splice()
+        {
+            if (flush_splice())
+            {
+                write_ev_.remove();
+                if (eof_)
+                    shutdown_write();
+                else if (paused_)
+                {
+                    paused_ = false;
+                    read_ev_.add();
+                }
+            }
+            else if (!paused_)
+            {
+                // пока pipe не опустеет источник не читаем
+                paused_ = true;
+                read_ev_.remove();
+                write_ev_.add();
+            }
+        }
+
+        void on_splice_read(evutil_socket_t fd, event_flag)
+        {
+            try {
+                auto rc = ::splice(fd, nullptr, pipe_[1], nullptr,
+                    owner_.high_, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+                if (rc > 0)
+                {
+                    in_pipe_ += static_cast<std::size_t>(rc);
+                    bytes_ += static_cast<std::size_t>(rc);
+                }
+                else if (rc == 0)
+                {
+                    eof_ = true;
+                    read_ev_.remove();
+                }
+                else if (errno != EAGAIN)
+                {
+                    owner_.finish(BEV_EVENT_READING|BEV_EVENT_ERROR);
+                    return;
+                }
+
+                update_splice();
+            }
+            catch (...)
+            {
+                owner_.finish(BEV_EVENT_WRITING|BEV_EVENT_ERROR);
+                return;
+            }
+            owner_.check_done();
+        }
+
+        void on_splice_write(evutil_socket_t, event_flag)
+        {
+            try {
+                update_splice();
+            }
+            catch (...)
+            {
+                owner_.finish(BEV_EVENT_WRITING|BEV_EVENT_ERROR);
+                return;
+            }
+            owner_.check_done();
+        }
+#endif // __linux__
+
+        void stop() noexcept
+        {
+            if (from_)
+            {
+                from_.set(nullptr, nullptr, nullptr, nullptr);
+                from_.set_watermark(EV_WRITE, 0, 0);
+            }
+#ifdef __linux__
+            stop_splice();
+#endif // __linux__
+        }
+    };
+
+    direction ab_{*this};
+    direction ba_{*this};
+    std::size_t high_{default_high_watermark};
+    std::size_t low_{default_high_watermark / 2};
+    mode mode_{mode::buffer};
+    bool running_{};
+    done_fun done_{};
+
+    direction& other(const direction& dir) noexcept
+    {
+        return (&dir == &ab_) ? ba_ : ab_;
+    }
+
+    void check_done()
+    {
+        if (running_ && ab_.done_ && ba_.done_)
+            finish(BEV_EVENT_EOF);
+    }
+
+    void finish(short what) noexcept
+    {
+        if (!running_)
+            return;
+
+        stop();
+        // обработчик может разрушить relay, вызываем последним
+        auto fn = std::move(done_);
+        if (fn)
+        {
+            try {
+                fn(what);
+            }
+            catch (...)
+            {   }
+        }
+    }
+
+public:
+    relay() = default;
+    relay(const relay&) = delete;
+    relay& operator=(const relay&) = delete;
+
+    ~relay() noexcept
+    {
+        stop();
+    }
+
+    // high - размер выходного буфера при котором чтение с другой стороны
+    // приостанавливается, возобновляется на low
+    void set_watermark(std::size_t low, std::size_t high) noexcept
+    {
+        assert(low < high);
+        low_ = low;
+        high_ = high;
+    }
+
+    static constexpr bool splice_supported() noexcept
+    {
+#ifdef __linux__
+        return true;
+#else
+        return false;
+#endif // __linux__
+    }
+
+    // обе стороны должны быть подключены
+    // для splice нужны socket bufferevent без фильтров и ssl
+    void start(buffer_event_ref a, buffer_event_ref b, done_fun fn,
+        mode m = mode::buffer)
+    {
+        assert(a && b && !running_);
+        ab_.from_ = a;
+        ab_.to_ = b;
+        ba_.from_ = b;
+        ba_.to_ = a;
+        done_ = std::move(fn);
+        mode_ = m;
+
+        if (m == mode::splice)
+        {
+#ifdef __linux__
+            if ((a.fd() == -1) || (b.fd() == -1))
+                throw std::runtime_error("relay splice requires sockets");
+            a.disable(EV_READ|EV_WRITE);
+            b.disable(EV_READ|EV_WRITE);
+            ab_.start_splice();
+            ba_.start_splice();
+#else
+            throw std::runtime_error("relay splice not supported");
+#endif // __linux__
+        }
+        else
+        {
+            ab_.start_buffer();
+            ba_.start_buffer();
+        }
+
+        running_ = true;
+    }
+
+    template<class A, class B>
+    void start(basic_buffer_event<A>& a, basic_buffer_event<B>& b,
+        done_fun fn, mode m = mode::buffer)
+    {
+        start(buffer_event_ref{a.handle()},
+            buffer_event_ref{b.handle()}, std::move(fn), m);
+    }
+
+    // отключает калбеки, сами buffer_event остаются у владельца
+    void stop() noexcept
+    {
+        if (running_)
+        {
+            running_ = false;
+            ab_.stop();
+            ba_.stop();
+        }
+    }
+
+    bool running() const noexcept
+    {
+        return running_;
+    }
+
+    mode current_mode() const noexcept
+    {
+        return mode_;
+    }
+
+    // байт переслано из a в b
+    std::uint64_t forwarded_ab() const noexcept
+    {
+        return ab_.bytes_;
+    }
+
+    // байт переслано из b в a
+    std::uint64_t forwarded_ba() const noexcept
+    {
+        return ba_.bytes_;
+    }
+};
+
+} // namespace e4pp
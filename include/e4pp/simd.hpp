@@ -0,0 +1,45 @@
+#pragma once
+
+// выбор SIMD во время выполнения, код собирается без -march
+// E4PP_NO_SIMD отключает все векторные пути
+
+#if !defined(E4PP_NO_SIMD) && \
+    (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define E4PP_SIMD_X86
+#include <immintrin.h>
+#endif
+
+namespace e4pp {
+namespace simd {
+
+enum class level
+{
+    scalar,
+    sse2,
+    ssse3,
+    avx2
+};
+
+inline level detect() noexcept
+{
+#ifdef E4PP_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return level::avx2;
+    if (__builtin_cpu_supports("ssse3"))
+        return level::ssse3;
+    if (__builtin_cpu_supports("sse2"))
+        return level::sse2;
+#endif // E4PP_SIMD_X86
+    return level::scalar;
+}
+
+inline level current() noexcept
+{
+    static const auto rc = detect();
+    return rc;
+}
+
+} // namespace simd
+} // namespace e4pp
@@ -0,0 +1,350 @@
+#pragma once
+
+#include "e4pp/buffer_event.hpp"
+
+#include <mutex>
+#include <limits>
+#include <algorithm>
+#include <vector>
+#include <memory>
+
+namespace e4ppx {
+namespace compress {
+
+enum class step_mode
+{
+    run,
+    flush,
+    finish
+};
+
+struct step_result
+{
+    std::size_t consumed{};
+    std::size_t produced{};
+    // выходной буфер заполнен, у кодека могут остаться данные
+    bool pending{};
+    bool ok{true};
+};
+
+// когда сбрасывать сжатые данные в сеть
+enum class flush_policy
+{
+    // после каждой записи, меньше задержка
+    sync,
+    // только по bufferevent_flush(BEV_FLUSH/BEV_FINISHED), лучше сжатие
+    manual
+};
+
+// пул кодеков, контексты zlib/zstd дорого создавать на каждое соединение
+template<class T>
+class pool final
+{
+public:
+    using value_type = T;
+    using options_type = typename T::options;
+    using ptr_type = std::unique_ptr<T>;
+
+private:
+    std::mutex mutex_{};
+    std::vector<ptr_type> free_{};
+    options_type options_{};
+    std::size_t max_size_{};
+
+public:
+    explicit pool(const options_type& options = {},
+        std::size_t max_size = 64)
+        : options_{options}
+        , max_size_{max_size}
+    {   }
+
+    pool(const pool&) = delete;
+    pool& operator=(const pool&) = delete;
+
+    ptr_type acquire()
+    {
+        {
+            std::lock_guard<std::mutex> l{mutex_};
+            if (!free_.empty())
+            {
+                auto rc = std::move(free_.back());
+                free_.pop_back();
+                return rc;
+            }
+        }
+        return std::make_unique<T>(options_);
+    }
+
+    void release(ptr_type ptr) noexcept
+    {
+        if (ptr)
+        {
+            ptr->reset();
+            std::lock_guard<std::mutex> l{mutex_};
+            if (free_.size() < max_size_)
+                free_.push_back(std::move(ptr));
+        }
+    }
+
+    const options_type& options() const noexcept
+    {
+        return options_;
+    }
+};
+
+// прогоняет src через кодек в dst без промежуточных копий
+// вход читается сегментами evbuffer, выход пишется в резерв dst
+// last - режим для кодека после того как вход закончился
+// limit - предел размера dst, защита от распаковки бомб
+template<class C>
+bool pump(C& coder, evbuffer* src, evbuffer* dst,
+    step_mode last, std::size_t chunk = 16384,
+    std::size_t limit = (std::numeric_limits<std::size_t>::max)()) noexcept
+{
+    assert(src && dst);
+    for (;;)
+    {
+        evbuffer_iovec in{};
+        auto has_input = (evbuffer_peek(src, -1, nullptr, &in, 1) > 0) &&
+            (in.iov_len > 0);
+        if (!has_input)
+            in = {};
+
+        evbuffer_iovec out{};
+        if (evbuffer_reserve_space(dst,
+            static_cast<ev_ssize_t>(chunk), &out, 1) != 1)
+            return false;
+
+        auto r = coder.step(in.iov_base, in.iov_len,
+            out.iov_base, out.iov_len, has_input ? step_mode::run : last);
+
+        out.iov_len = r.produced;
+        if (evbuffer_commit_space(dst, &out, 1) == -1)
+            return false;
+
+        if (r.consumed)
+            evbuffer_drain(src, r.consumed);
+
+        if (!r.ok || (evbuffer_get_length(dst) > limit))
+            return false;
+
+        if (!(has_input || r.pending))
+            return true;
+
+        // кодек не может продвинуться
+        if (!(r.consumed || r.produced || r.pending))
+            return true;
+    }
+}
+
+// то же, но с бюджетом на прирост dst за вызов
+// soft - после него вход остается в src до следующего вызова
+// если src уже пуст, libevent сам фильтр не позовет,
+// поэтому остаток кодека дочищается
+// limit - предел размера dst, превышение это ошибка
+template<class C>
+bool pump_bounded(C& coder, evbuffer* src, evbuffer* dst,
+    std::size_t soft, std::size_t limit, std::size_t chunk = 16384) noexcept
+{
+    assert(src && dst);
+    auto start = evbuffer_get_length(dst);
+    for (;;)
+    {
+        auto produced = evbuffer_get_length(dst) - start;
+        auto room = produced < soft;
+        if (!room && (evbuffer_get_length(src) > 0))
+            return true;
+
+        evbuffer_iovec in{};
+        auto has_input = room &&
+            (evbuffer_peek(src, -1, nullptr, &in, 1) > 0) &&
+            (in.iov_len > 0);
+        if (!has_input)
+            in = {};
+
+        auto size = room ? (std::min)(chunk, soft - produced) : chunk;
+        evbuffer_iovec out{};
+        if (evbuffer_reserve_space(dst,
+            static_cast<ev_ssize_t>(size), &out, 1) != 1)
+            return false;
+
+        auto r = coder.step(in.iov_base, in.iov_len,
+            out.iov_base, (std::min)(out.iov_len, size), step_mode::run);
+
+        out.iov_len = r.produced;
+        if (evbuffer_commit_space(dst, &out, 1) == -1)
+            return false;
+
+        if (r.consumed)
+            evbuffer_drain(src, r.consumed);
+
+        if (!r.ok || (evbuffer_get_length(dst) > limit))
+            return false;
+
+        if (!(has_input || r.pending))
+            return true;
+
+        if (!(r.consumed || r.produced || r.pending))
+            return true;
+    }
+}
+
+// фильтр bufferevent_filter_new: сжатие на выходе и распаковка на входе
+// протокол продолжает работать с input()/output() как обычно
+// libevent освобождает контекст фильтра отложенно, поэтому пулы
+// разделяются с контекстами и переживают сам compress_filter
+template<class E, class D>
+class compress_filter final
+{
+public:
+    using encoder_type = E;
+    using decoder_type = D;
+
+private:
+    struct state final
+    {
+        pool<E> encoders;
+        pool<D> decoders;
+        flush_policy policy;
+        // предел непрочитанных распакованных данных в input()
+        std::size_t max_decoded;
+
+        state(const typename E::options& encoder_options,
+            const typename D::options& decoder_options,
+            flush_policy p, std::size_t max_pooled, std::size_t max_dec)
+            : encoders{encoder_options, max_pooled}
+            , decoders{decoder_options, max_pooled}
+            , policy{p}
+            , max_decoded{max_dec}
+        {   }
+    };
+
+    struct context final
+    {
+        std::shared_ptr<state> owner;
+        typename pool<E>::ptr_type encoder;
+        typename pool<D>::ptr_type decoder;
+        bufferevent* self{};
+        bufferevent* underlying{};
+    };
+
+    std::shared_ptr<state> state_;
+
+    // dst_limit - сколько еще влезет до верхней отметки чтения
+    // -1 если отметка не задана
+    static bufferevent_filter_result input_filter(evbuffer* src,
+        evbuffer* dst, ev_ssize_t dst_limit, bufferevent_flush_mode,
+        void* arg) noexcept
+    {
+        assert(arg);
+        auto ctx = static_cast<context*>(arg);
+        auto soft = (dst_limit < 0) ?
+            (std::numeric_limits<std::size_t>::max)() :
+            static_cast<std::size_t>(dst_limit);
+        if (pump_bounded(*ctx->decoder, src, dst,
+            soft, ctx->owner->max_decoded))
+            return BEV_OK;
+
+        // libevent 2.1 не смотрит на результат входного фильтра
+        if (ctx->self)
+        {
+            bufferevent_disable(ctx->self, EV_READ);
+            bufferevent_trigger_event(ctx->self,
+                BEV_EVENT_READING|BEV_EVENT_ERROR, BEV_TRIG_DEFER_CALLBACKS);
+        }
+        return BEV_ERROR;
+    }
+
+    // libevent вызывает readcb раньше, чем взводит свой inbuf_cb,
+    // если input() разобран прямо в readcb, остаток в underlying
+    // ждал бы новых данных из сети
+    static void input_cb(evbuffer*, const evbuffer_cb_info* info,
+        void* arg) noexcept
+    {
+        assert(arg);
+        auto ctx = static_cast<context*>(arg);
+        if (info->n_deleted &&
+            evbuffer_get_length(bufferevent_get_input(ctx->underlying)))
+            bufferevent_trigger(ctx->underlying, EV_READ,
+                BEV_TRIG_IGNORE_WATERMARKS|BEV_TRIG_DEFER_CALLBACKS);
+    }
+
+    static bufferevent_filter_result output_filter(evbuffer* src,
+        evbuffer* dst, ev_ssize_t, bufferevent_flush_mode mode,
+        void* arg) noexcept
+    {
+        assert(arg);
+        auto ctx = static_cast<context*>(arg);
+        auto last = step_mode::run;
+        if (mode == BEV_FINISHED)
+            last = step_mode::finish;
+        else if ((mode == BEV_FLUSH) ||
+            (ctx->owner->policy == flush_policy::sync))
+            last = step_mode::flush;
+
+        return pump(*ctx->encoder, src, dst, last) ? BEV_OK : BEV_ERROR;
+    }
+
+    static void free_context(void* arg) noexcept
+    {
+        assert(arg);
+        auto ctx = static_cast<context*>(arg);
+        ctx->owner->encoders.release(std::move(ctx->encoder));
+        ctx->owner->decoders.release(std::move(ctx->decoder));
+        delete ctx;
+    }
+
+public:
+    // max_decoded - сколько распакованного может ждать в input(),
+    // больше - ошибка чтения, защита от распаковки бомб
+    explicit compress_filter(const typename E::options& encoder_options = {},
+        const typename D::options& decoder_options = {},
+        flush_policy policy = flush_policy::sync,
+        std::size_t max_pooled = 64,
+        std::size_t max_decoded = (std::numeric_limits<std::size_t>::max)())
+        : state_{std::make_shared<state>(encoder_options,
+            decoder_options, policy, max_pooled, max_decoded)}
+    {   }
+
+    compress_filter(const compress_filter&) = delete;
+    compress_filter& operator=(const compress_filter&) = delete;
+
+    // фильтр забирает underlying и освобождает его вместе с собой
+    template<class T>
+    e4pp::buffer_event wrap(e4pp::basic_buffer_event<T> underlying,
+        e4pp::bev_flag opt = e4pp::bev_close_on_free)
+    {
+        assert(underlying);
+        auto ctx = std::make_unique<context>(context{state_,
+            state_->encoders.acquire(), state_->decoders.acquire()});
+
+        auto ptr = e4pp::detail::check_pointer("bufferevent_filter_new",
+            bufferevent_filter_new(underlying.handle(),
+                input_filter, output_filter,
+                opt|BEV_OPT_CLOSE_ON_FREE, free_context, ctx.get()));
+        auto arg = ctx.release();
+        arg->self = ptr;
+        arg->underlying = underlying.release();
+
+        e4pp::buffer_event result{e4pp::bev{ptr}};
+        // free_context отрабатывает до evbuffer_free(input),
+        // а evbuffer_free колбэков не зовет
+        e4pp::detail::check_pointer("evbuffer_add_cb",
+            evbuffer_add_cb(bufferevent_get_input(ptr), input_cb, arg));
+        result.enable(EV_READ|EV_WRITE);
+        return result;
+    }
+
+    flush_policy policy() const noexcept
+    {
+        return state_->policy;
+    }
+
+    std::size_t max_decoded() const noexcept
+    {
+        return state_->max_decoded;
+    }
+};
+
+} // namespace compress
+} // namespace e4ppx
@@ -0,0 +1,164 @@
+#pragma once
+
+#include "e4ppx/compress/filter.hpp"
+
+#include <zlib.h>
+#include <limits>
+#include <stdexcept>
+
+namespace e4ppx {
+namespace compress {
+namespace detail {
+
+inline uInt clamp_avail(std::size_t len) noexcept
+{
+    constexpr std::size_t max = (std::numeric_limits<uInt>::max)();
+    return static_cast<uInt>((len < max) ? len : max);
+}
+
+} // namespace detail
+
+struct deflate_options
+{
+    int level{Z_DEFAULT_COMPRESSION};
+    // 8..15 zlib, -8..-15 raw deflate, 16+ gzip
+    int window_bits{15};
+    int mem_level{8};
+    int strategy{Z_DEFAULT_STRATEGY};
+};
+
+class deflate_encoder final
+{
+public:
+    using options = deflate_options;
+
+private:
+    z_stream z_{};
+
+public:
+    explicit deflate_encoder(const options& opt = {})
+    {
+        if (deflateInit2(&z_, opt.level, Z_DEFLATED, opt.window_bits,
+            opt.mem_level, opt.strategy) != Z_OK)
+            throw std::runtime_error("deflateInit2");
+    }
+
+    deflate_encoder(const deflate_encoder&) = delete;
+    deflate_encoder& operator=(const deflate_encoder&) = delete;
+
+    ~deflate_encoder() noexcept
+    {
+        deflateEnd(&z_);
+    }
+
+    // начать новый поток, выделенная память сохраняется
+    void reset() noexcept
+    {
+        deflateReset(&z_);
+    }
+
+    step_result step(const void* in, std::size_t in_len,
+        void* out, std::size_t out_len, step_mode mode) noexcept
+    {
+        z_.next_in = static_cast<Bytef*>(const_cast<void*>(in));
+        z_.avail_in = detail::clamp_avail(in_len);
+        z_.next_out = static_cast<Bytef*>(out);
+        z_.avail_out = detail::clamp_avail(out_len);
+        auto avail_in = z_.avail_in;
+        auto avail_out = z_.avail_out;
+
+        int flush = Z_NO_FLUSH;
+        if (mode == step_mode::flush)
+            flush = Z_SYNC_FLUSH;
+        else if (mode == step_mode::finish)
+            flush = Z_FINISH;
+
+        auto rc = deflate(&z_, flush);
+
+        step_result r;
+        r.consumed = avail_in - z_.avail_in;
+        r.produced = avail_out - z_.avail_out;
+        r.pending = (z_.avail_out == 0);
+        // Z_BUF_ERROR - нет продвижения, это не ошибка
+        r.ok = (rc == Z_OK) || (rc == Z_BUF_ERROR) || (rc == Z_STREAM_END);
+        if (rc == Z_STREAM_END)
+            reset();
+        return r;
+    }
+
+    z_stream& handle() noexcept
+    {
+        return z_;
+    }
+};
+
+struct inflate_options
+{
+    // 8..15 zlib, -8..-15 raw deflate, 15+32 zlib или gzip
+    int window_bits{15};
+};
+
+class inflate_decoder final
+{
+public:
+    using options = inflate_options;
+
+private:
+    z_stream z_{};
+
+public:
+    explicit inflate_decoder(const options& opt = {})
+    {
+        if (inflateInit2(&z_, opt.window_bits) != Z_OK)
+            throw std::runtime_error("inflateInit2");
+    }
+
+    inflate_decoder(const inflate_decoder&) = delete;
+    inflate_decoder& operator=(const inflate_decoder&) = delete;
+
+    ~inflate_decoder() noexcept
+    {
+        inflateEnd(&z_);
+    }
+
+    void reset() noexcept
+    {
+        inflateReset(&z_);
+    }
+
+    step_result step(const void* in, std::size_t in_len,
+        void* out, std::size_t out_len, step_mode mode) noexcept
+    {
+        z_.next_in = static_cast<Bytef*>(const_cast<void*>(in));
+        z_.avail_in = detail::clamp_avail(in_len);
+        z_.next_out = static_cast<Bytef*>(out);
+        z_.avail_out = detail::clamp_avail(out_len);
+        auto avail_in = z_.avail_in;
+        auto avail_out = z_.avail_out;
+
+        auto rc = inflate(&z_,
+            (mode == step_mode::run) ? Z_NO_FLUSH : Z_SYNC_FLUSH);
+
+        step_result r;
+        r.consumed = avail_in - z_.avail_in;
+        r.produced = avail_out - z_.avail_out;
+        r.pending = (z_.avail_out == 0);
+        r.ok = (rc == Z_OK) || (rc == Z_BUF_ERROR) || (rc == Z_STREAM_END);
+        // следующий поток может идти сразу за концом текущего
+        if (rc == Z_STREAM_END)
+            reset();
+        return r;
+    }
+
+    z_stream& handle() noexcept
+    {
+        return z_;
+    }
+};
+
+using deflate_pool = pool<deflate_encoder>;
+using inflate_pool = pool<inflate_decoder>;
+using deflate_filter = compress_filter<deflate_encoder, inflate_decoder>;
+
+} // namespace compress
+} // namespace e4ppx
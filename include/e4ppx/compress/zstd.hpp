@@ -0,0 +1,149 @@
+#pragma once
+
+#include "e4ppx/compress/filter.hpp"
+
+#include <zstd.h>
+#include <stdexcept>
+
+namespace e4ppx {
+namespace compress {
+
+struct zstd_encoder_options
+{
+    int level{ZSTD_CLEVEL_DEFAULT};
+    // 0 - по умолчанию для уровня
+    int window_log{0};
+};
+
+class zstd_encoder final
+{
+public:
+    using options = zstd_encoder_options;
+
+private:
+    struct free_cctx
+    {
+        void operator()(ZSTD_CCtx* ptr) noexcept
+        {
+            ZSTD_freeCCtx(ptr);
+        }
+    };
+    std::unique_ptr<ZSTD_CCtx, free_cctx> ctx_{ZSTD_createCCtx()};
+
+    void set(ZSTD_cParameter param, int value)
+    {
+        if (ZSTD_isError(ZSTD_CCtx_setParameter(ctx_.get(), param, value)))
+            throw std::runtime_error("ZSTD_CCtx_setParameter");
+    }
+
+public:
+    explicit zstd_encoder(const options& opt = {})
+    {
+        if (!ctx_)
+            throw std::runtime_error("ZSTD_createCCtx");
+        set(ZSTD_c_compressionLevel, opt.level);
+        if (opt.window_log)
+            set(ZSTD_c_windowLog, opt.window_log);
+    }
+
+    // параметры сохраняются, сбрасывается только текущий фрейм
+    void reset() noexcept
+    {
+        ZSTD_CCtx_reset(ctx_.get(), ZSTD_reset_session_only);
+    }
+
+    step_result step(const void* in, std::size_t in_len,
+        void* out, std::size_t out_len, step_mode mode) noexcept
+    {
+        ZSTD_inBuffer input{in, in_len, 0};
+        ZSTD_outBuffer output{out, out_len, 0};
+
+        auto directive = ZSTD_e_continue;
+        if (mode == step_mode::flush)
+            directive = ZSTD_e_flush;
+        else if (mode == step_mode::finish)
+            directive = ZSTD_e_end;
+
+        auto rc = ZSTD_compressStream2(ctx_.get(),
+            &output, &input, directive);
+
+        step_result r;
+        r.consumed = input.pos;
+        r.produced = output.pos;
+        r.ok = !ZSTD_isError(rc);
+        // для flush/end rc - сколько еще осталось выдать
+        r.pending = (mode == step_mode::run) ?
+            (output.pos == output.size) : (r.ok && rc != 0);
+        return r;
+    }
+
+    ZSTD_CCtx* handle() const noexcept
+    {
+        return ctx_.get();
+    }
+};
+
+struct zstd_decoder_options
+{
+    // ограничение окна, защита от больших аллокаций, 0 - по умолчанию
+    int window_log_max{0};
+};
+
+class zstd_decoder final
+{
+public:
+    using options = zstd_decoder_options;
+
+private:
+    struct free_dctx
+    {
+        void operator()(ZSTD_DCtx* ptr) noexcept
+        {
+            ZSTD_freeDCtx(ptr);
+        }
+    };
+    std::unique_ptr<ZSTD_DCtx, free_dctx> ctx_{ZSTD_createDCtx()};
+
+public:
+    explicit zstd_decoder(const options& opt = {})
+    {
+        if (!ctx_)
+            throw std::runtime_error("ZSTD_createDCtx");
+        if (opt.window_log_max && ZSTD_isError(ZSTD_DCtx_setParameter(
+            ctx_.get(), ZSTD_d_windowLogMax, opt.window_log_max)))
+            throw std::runtime_error("ZSTD_DCtx_setParameter");
+    }
+
+    void reset() noexcept
+    {
+        ZSTD_DCtx_reset(ctx_.get(), ZSTD_reset_session_only);
+    }
+
+    step_result step(const void* in, std::size_t in_len,
+        void* out, std::size_t out_len, step_mode) noexcept
+    {
+        ZSTD_inBuffer input{in, in_len, 0};
+        ZSTD_outBuffer output{out, out_len, 0};
+
+        auto rc = ZSTD_decompressStream(ctx_.get(), &output, &input);
+
+        step_result r;
+        r.consumed = input.pos;
+        r.produced = output.pos;
+        r.pending = (output.pos == output.size);
+        r.ok = !ZSTD_isError(rc);
+        return r;
+    }
+
+    ZSTD_DCtx* handle() const noexcept
+    {
+        return ctx_.get();
+    }
+};
+
+using zstd_encoder_pool = pool<zstd_encoder>;
+using zstd_decoder_pool = pool<zstd_decoder>;
+using zstd_filter = compress_filter<zstd_encoder, zstd_decoder>;
+
+} // namespace compress
+} // namespace e4ppx
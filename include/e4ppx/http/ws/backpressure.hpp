@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstddef>
+
+namespace e4ppx {
+namespace http {
+namespace ws {
+
+// что делать с сообщениями медленного получателя
+enum class slow_policy
+{
+    // новые сообщения отбрасываются
+    drop,
+    // хранится только последнее, уходит когда вывод освободится
+    coalesce,
+    // соединение закрывается с BEV_EVENT_WRITING|BEV_EVENT_ERROR
+    disconnect
+};
+
+struct backpressure_options
+{
+    // выше high сессия перестает принимать сообщения, 0 - без предела
+    std::size_t high{};
+    // ниже low снова принимает, используется как EV_WRITE watermark
+    std::size_t low{};
+    slow_policy policy{slow_policy::drop};
+};
+
+// состояние вывода сессии с гистерезисом high/low
+class congestion final
+{
+    backpressure_options options_{};
+    bool congested_{};
+
+public:
+    congestion() = default;
+
+    explicit congestion(const backpressure_options& options) noexcept
+        : options_{options}
+    {   }
+
+    const backpressure_options& options() const noexcept
+    {
+        return options_;
+    }
+
+    bool congested() const noexcept
+    {
+        return congested_;
+    }
+
+    // @return true если при таком размере вывода можно писать
+    bool admit(std::size_t output_size) noexcept
+    {
+        if (!options_.high)
+            return true;
+        if (!congested_ && (output_size < options_.high))
+            return true;
+        congested_ = true;
+        return false;
+    }
+
+    // вывод опустел до low
+    // @return true если сессия была перегружена
+    bool drained(std::size_t output_size) noexcept
+    {
+        if (!congested_ || (output_size > options_.low))
+            return false;
+        congested_ = false;
+        return true;
+    }
+};
+
+} // namespace ws
+} // namespace http
+} // namespace e4ppx
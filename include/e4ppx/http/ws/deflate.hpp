@@ -0,0 +1,348 @@
+#pragma once
+
+#include "e4ppx/compress/zlib.hpp"
+#include "e4ppx/http/ws/frame.hpp"
+
+#include <string>
+#include <string_view>
+#include <charconv>
+
+// permessage-deflate (RFC 7692)
+// сообщение сжимается raw deflate с Z_SYNC_FLUSH, хвост 00 00 ff ff
+// отрезается при отправке и дописывается перед распаковкой
+
+namespace e4ppx {
+namespace http {
+namespace ws {
+namespace detail {
+
+inline std::string_view trim(std::string_view s) noexcept
+{
+    auto space = [](char c) {
+        return (c == ' ') || (c == '\t');
+    };
+    while (!s.empty() && space(s.front()))
+        s.remove_prefix(1);
+    while (!s.empty() && space(s.back()))
+        s.remove_suffix(1);
+    return s;
+}
+
+// следующий элемент списка через sep
+inline std::string_view next_item(std::string_view& list, char sep) noexcept
+{
+    auto pos = list.find(sep);
+    auto item = list.substr(0, pos);
+    list = (pos == std::string_view::npos) ?
+        std::string_view{} : list.substr(pos + 1);
+    return trim(item);
+}
+
+// 8..15, значение может быть в кавычках
+inline int parse_window_bits(std::string_view val) noexcept
+{
+    if ((val.size() >= 2) && (val.front() == '"') && (val.back() == '"'))
+        val = val.substr(1, val.size() - 2);
+
+    int rc = 0;
+    auto [end, ec] = std::from_chars(val.data(), val.data() + val.size(), rc);
+    if ((ec != std::errc{}) || (end != val.data() + val.size()) ||
+        (rc < 8) || (rc > 15))
+        return 0;
+    return rc;
+}
+
+} // namespace detail
+
+// параметры расширения: локальные настройки и результат согласования
+struct permessage_deflate
+{
+    bool enabled{};
+    // сбрасывать словарь после каждого сообщения
+    bool server_no_context_takeover{};
+    bool client_no_context_takeover{};
+    // окно LZ77 9..15, окно 8 zlib для raw deflate не поддерживает
+    int server_max_window_bits{15};
+    int client_max_window_bits{15};
+    int level{Z_DEFAULT_COMPRESSION};
+    int mem_level{8};
+    // сообщения короче порога отправляются без сжатия
+    std::size_t threshold{256};
+
+    // Sec-WebSocket-Extensions для запроса клиента
+    std::string offer() const
+    {
+        std::string rc{"permessage-deflate"};
+        if (server_no_context_takeover)
+            rc += "; server_no_context_takeover";
+        if (client_no_context_takeover)
+            rc += "; client_no_context_takeover";
+        if (server_max_window_bits < 15)
+        {
+            rc += "; server_max_window_bits=";
+            rc += std::to_string(server_max_window_bits);
+        }
+        rc += "; client_max_window_bits";
+        if (client_max_window_bits < 15)
+        {
+            rc += '=';
+            rc += std::to_string(client_max_window_bits);
+        }
+        return rc;
+    }
+
+    // сервер: выбирает первое подходящее предложение клиента
+    // agreed и response меняются только при успехе
+    // @return false если расширение не используется
+    bool negotiate(std::string_view offers, permessage_deflate& agreed,
+        std::string& response) const
+    {
+        while (!offers.empty())
+        {
+            auto params = detail::next_item(offers, ',');
+            if (detail::next_item(params, ';') != "permessage-deflate")
+                continue;
+
+            permessage_deflate rc = *this;
+            rc.enabled = true;
+            bool client_bits = false;
+            bool valid = true;
+            while (valid && !params.empty())
+            {
+                auto param = detail::next_item(params, ';');
+                auto eq = param.find('=');
+                auto name = detail::trim(param.substr(0, eq));
+                auto val = (eq == std::string_view::npos) ?
+                    std::string_view{} : detail::trim(param.substr(eq + 1));
+
+                if (name == "server_no_context_takeover")
+                {
+                    valid = val.empty();
+                    rc.server_no_context_takeover = true;
+                }
+                else if (name == "client_no_context_takeover")
+                {
+                    valid = val.empty();
+                    rc.client_no_context_takeover = true;
+                }
+                else if (name == "server_max_window_bits")
+                {
+                    auto bits = detail::parse_window_bits(val);
+                    valid = bits > 8;
+                    rc.server_max_window_bits =
+                        (std::min)(rc.server_max_window_bits, bits);
+                }
+                else if (name == "client_max_window_bits")
+                {
+                    client_bits = true;
+                    if (!val.empty())
+                    {
+                        auto bits = detail::parse_window_bits(val);
+                        valid = bits != 0;
+                        rc.client_max_window_bits =
+                            (std::min)(rc.client_max_window_bits, bits);
+                    }
+                }
+                else
+                    valid = false;
+            }
+
+            // без client_max_window_bits клиент может использовать окно 15
+            if (!client_bits)
+                rc.client_max_window_bits = 15;
+            if (!valid || (rc.client_max_window_bits < 9))
+                continue;
+
+            response = "permessage-deflate";
+            if (rc.server_no_context_takeover)
+                response += "; server_no_context_takeover";
+            if (rc.client_no_context_takeover)
+                response += "; client_no_context_takeover";
+            if (rc.server_max_window_bits < 15)
+            {
+                response += "; server_max_window_bits=";
+                response += std::to_string(rc.server_max_window_bits);
+            }
+            if (client_bits && (rc.client_max_window_bits < 15))
+            {
+                response += "; client_max_window_bits=";
+                response += std::to_string(rc.client_max_window_bits);
+            }
+            agreed = rc;
+            return true;
+        }
+        return false;
+    }
+
+    // клиент: разбирает ответ сервера на offer()
+    // agreed меняется только при успехе
+    // @return false если ответ нарушает предложение
+    bool accept(std::string_view response, permessage_deflate& agreed) const
+    {
+        auto params = detail::next_item(response, ',');
+        if (!response.empty() ||
+            (detail::next_item(params, ';') != "permessage-deflate"))
+            return false;
+
+        permessage_deflate rc = *this;
+        rc.enabled = true;
+        while (!params.empty())
+        {
+            auto param = detail::next_item(params, ';');
+            auto eq = param.find('=');
+            auto name = detail::trim(param.substr(0, eq));
+            auto val = (eq == std::string_view::npos) ?
+                std::string_view{} : detail::trim(param.substr(eq + 1));
+
+            if ((name == "server_no_context_takeover") && val.empty())
+                rc.server_no_context_takeover = true;
+            else if ((name == "client_no_context_takeover") && val.empty())
+                rc.client_no_context_takeover = true;
+            else if (name == "server_max_window_bits")
+            {
+                auto bits = detail::parse_window_bits(val);
+                if (!bits || (bits > server_max_window_bits))
+                    return false;
+                rc.server_max_window_bits = bits;
+            }
+            else if (name == "client_max_window_bits")
+            {
+                auto bits = detail::parse_window_bits(val);
+                if ((bits < 9) || (bits > client_max_window_bits))
+                    return false;
+                rc.client_max_window_bits = bits;
+            }
+            else
+                return false;
+        }
+        agreed = rc;
+        return true;
+    }
+};
+
+// потоки zlib одной сессии, живут все время соединения
+// и переиспользуют словарь между сообщениями если это согласовано
+class deflate_codec final
+{
+    compress::deflate_encoder encoder_;
+    compress::inflate_decoder decoder_;
+    e4pp::buffer scratch_{};
+    std::size_t threshold_{};
+    bool reset_encoder_{};
+    bool reset_decoder_{};
+
+    static compress::deflate_options encoder_options(
+        const permessage_deflate& p, bool server)
+    {
+        compress::deflate_options rc;
+        rc.level = p.level;
+        rc.mem_level = p.mem_level;
+        rc.window_bits = -(server ?
+            p.server_max_window_bits : p.client_max_window_bits);
+        return rc;
+    }
+
+    // окно распаковки всегда максимальное, оно вмещает любое окно пира
+    static compress::inflate_options decoder_options() noexcept
+    {
+        compress::inflate_options rc;
+        rc.window_bits = -15;
+        return rc;
+    }
+
+public:
+    static constexpr unsigned char tail[] = { 0x00, 0x00, 0xff, 0xff };
+
+    deflate_codec(const permessage_deflate& p, bool server)
+        : encoder_{encoder_options(p, server)}
+        , decoder_{decoder_options()}
+        , threshold_{p.threshold}
+        , reset_encoder_{server ?
+            p.server_no_context_takeover : p.client_no_context_takeover}
+        , reset_decoder_{server ?
+            p.client_no_context_takeover : p.server_no_context_takeover}
+    {   }
+
+    deflate_codec(const deflate_codec&) = delete;
+    deflate_codec& operator=(const deflate_codec&) = delete;
+
+    std::size_t threshold() const noexcept
+    {
+        return threshold_;
+    }
+
+    bool use(std::size_t len) const noexcept
+    {
+        return len >= threshold_;
+    }
+
+    // сжимает src целиком в dst, src опустошается
+    bool compress(evbuffer* src, evbuffer* dst)
+    {
+        assert(src && dst);
+        // повторный Z_SYNC_FLUSH без входа zlib отклоняет (Z_BUF_ERROR),
+        // пустое сообщение - пустой stored блок 0x00 (RFC 7692 7.2.3.6),
+        // словарь потока он не меняет
+        if (!evbuffer_get_length(src))
+        {
+            static constexpr unsigned char empty[] = { 0x00 };
+            return evbuffer_add(dst, empty, sizeof(empty)) == 0;
+        }
+
+        auto ok = compress::pump(encoder_, src, scratch_.handle(),
+            compress::step_mode::flush);
+
+        auto size = scratch_.size();
+        if (ok && (size >= sizeof(tail)))
+        {
+            ok = evbuffer_remove_buffer(scratch_.handle(), dst,
+                size - sizeof(tail)) != -1;
+        }
+        else
+            ok = false;
+
+        scratch_.drain(scratch_.size());
+        if (reset_encoder_ || !ok)
+            encoder_.reset();
+        return ok;
+    }
+
+    bool compress(const void* data, std::size_t len, evbuffer* dst)
+    {
+        e4pp::buffer src;
+        if (len)
+        {
+            e4pp::detail::check_result("evbuffer_add_reference",
+                evbuffer_add_reference(src.handle(),
+                    data, len, nullptr, nullptr));
+        }
+        return compress(src.handle(), dst);
+    }
+
+    // распаковывает первые len байт src в dst
+    // src может совпадать с dst, данные сначала переносятся
+    // last - конец сообщения, при потоковом приеме сообщение
+    // распаковывается частями по мере прихода
+    // @return false при ошибке потока или если dst больше limit
+    bool decompress(evbuffer* src, std::size_t len, evbuffer* dst,
+        std::size_t limit, bool last = true)
+    {
+        assert(src && dst);
+        e4pp::detail::check_result("evbuffer_remove_buffer",
+            evbuffer_remove_buffer(src, scratch_.handle(), len));
+        if (last)
+            scratch_.append(tail, sizeof(tail));
+
+        auto ok = compress::pump(decoder_, scratch_.handle(), dst,
+            compress::step_mode::run, 16384, limit);
+
+        scratch_.drain(scratch_.size());
+        if ((last && reset_decoder_) || !ok)
+            decoder_.reset();
+        return ok;
+    }
+};
+
+} // namespace ws
+} // namespace http
+} // namespace e4ppx
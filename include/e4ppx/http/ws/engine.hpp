@@ -0,0 +1,788 @@
+#pragma once
+
+#include "e4ppx/http/ws/frame.hpp"
+#include "e4ppx/http/ws/deflate.hpp"
+#include "e4ppx/http/ws/backpressure.hpp"
+#include "e4ppx/ssl/rand.hpp"
+#include "e4pp/buffer_event.hpp"
+
+#include <memory>
+#include <string_view>
+
+namespace e4ppx {
+namespace http {
+namespace ws {
+
+enum class role
+{
+    client,
+    server
+};
+
+// сокет принимающий сообщение частями, fin - последняя часть
+template<class T>
+concept streaming_socket = requires(T& t, opcode op,
+    const char* ptr, std::size_t len)
+{
+    t.message(op, ptr, len, true);
+};
+
+// собственный разбор и сборка кадров вместо wslay
+// кадры разбираются прямо во входном evbuffer: payload демаскируется
+// на месте по сегментам, целое сообщение из одного сегмента
+// отдается без копирования, фрагменты переносятся цепочками
+// исходящие кадры пишутся в резерв выходного буфера
+// с permessage-deflate сжимаются только целые сообщения от порога
+//
+// T должен иметь
+//   void message(opcode, const char*, std::size_t)
+//   void on_event(short what)
+// и может иметь
+//   void message(opcode, const char*, std::size_t, bool fin)
+//       для потокового приема, см. set_streaming
+//   void on_ping(const char*, std::size_t)
+//   void on_pong(const char*, std::size_t)
+//   void on_close(std::uint16_t code, std::string_view reason)
+//   void on_writable() - вывод освободился после перегрузки
+//
+// on_event получает BEV_EVENT_EOF после завершения close handshake,
+// BEV_EVENT_ERROR при нарушении протокола и события bufferevent
+// разрушать engine из калбеков нельзя
+template<class T>
+class engine final
+{
+public:
+    using socket_type = T;
+    using this_type = engine<T>;
+
+    static constexpr std::size_t default_max_message_size =
+        16 * 1024 * 1024;
+
+private:
+    T& ws_;
+    role role_{role::client};
+    e4pp::buffer_event_ref bev_{};
+    // фрагменты текущего сообщения
+    e4pp::buffer message_{};
+    opcode message_op_{opcode::continuation};
+    bool message_compressed_{};
+    std::unique_ptr<deflate_codec> deflate_{};
+    // потоковый прием: payload отдается по мере прихода
+    bool streaming_{};
+    bool in_frame_{};
+    frame_header frame_{};
+    std::uint64_t frame_left_{};
+    std::size_t frame_offset_{};
+    opcode stream_op_{opcode::continuation};
+    // отдано из текущего сообщения
+    std::size_t message_size_{};
+    // медленный получатель
+    congestion congestion_{};
+    // последнее сообщение при slow_policy::coalesce, уже кадр
+    e4pp::buffer coalesced_{};
+    bool skip_fragments_{};
+    // отправлен кадр без fin, до последнего фрагмента
+    // другие сообщения данных вставлять нельзя (RFC 6455 5.4)
+    bool fragmenting_{};
+    bool disconnected_{};
+
+    enum class verdict
+    {
+        write,
+        drop,
+        coalesce
+    };
+    // сжатый payload перед записью кадра
+    e4pp::buffer deflated_{};
+    std::size_t max_message_size_{default_max_message_size};
+    bool watermark_{};
+    bool close_sent_{};
+    bool close_received_{};
+    bool closing_{};
+
+    frame_header make_header(opcode op, bool fin) const
+    {
+        frame_header h;
+        h.fin = fin;
+        h.op = op;
+        // клиент обязан маскировать, сервер не должен
+        if (role_ == role::client)
+        {
+            h.masked = true;
+            openssl::rand_pool::local()(h.mask.data(), h.mask.size());
+        }
+        return h;
+    }
+
+    void send_close(std::uint16_t code, std::string_view reason)
+    {
+        unsigned char payload[max_control_payload];
+        std::size_t len = 0;
+        if (code)
+        {
+            payload[0] = static_cast<unsigned char>(code >> 8);
+            payload[1] = static_cast<unsigned char>(code);
+            len = (std::min)(reason.size(), max_control_payload - 2);
+            if (len)
+                std::memcpy(payload + 2, reason.data(), len);
+            len += 2;
+        }
+
+        close_sent_ = true;
+        auto output = bev_.output();
+        // отложенное сообщение уже принято send, после close
+        // кадры данных запрещены (RFC 6455 5.5.1), оно уходит перед ним
+        if (!coalesced_.empty())
+        {
+            e4pp::detail::check_result("evbuffer_add_buffer",
+                evbuffer_add_buffer(output.handle(), coalesced_.handle()));
+        }
+        write_frame(output, make_header(opcode::close, true), payload, len);
+    }
+
+    // ответный close уходит, соединение закрывается когда вывод опустеет
+    void finish_close()
+    {
+        bev_.disable(EV_READ);
+        if (bev_.output().empty())
+            ws_.on_event(BEV_EVENT_EOF);
+        else
+            closing_ = true;
+    }
+
+    void disconnect() noexcept
+    {
+        disconnected_ = true;
+        coalesced_.drain(coalesced_.size());
+        bev_.disable(EV_READ);
+        // из send нельзя звать on_event напрямую, владелец может удалить
+        // сессию, событие придет из цикла
+        bufferevent_trigger_event(bev_.handle(),
+            BEV_EVENT_WRITING|BEV_EVENT_ERROR, BEV_TRIG_DEFER_CALLBACKS);
+    }
+
+    // решение для сообщения при текущем размере вывода
+    // управляющие кадры и продолжения начатых сообщений не трогаются
+    verdict admit(opcode op, bool fin)
+    {
+        if (is_control(op))
+            return verdict::write;
+        if (op == opcode::continuation)
+        {
+            if (skip_fragments_)
+                return verdict::drop;
+            fragmenting_ = !fin;
+            return verdict::write;
+        }
+        assert(!fragmenting_);
+
+        auto rc = verdict::drop;
+        if (disconnected_)
+            rc = verdict::drop;
+        else if (congestion_.admit(bev_.output().size()))
+            rc = verdict::write;
+        else if (congestion_.options().policy == slow_policy::coalesce)
+            rc = verdict::coalesce;
+        else if (congestion_.options().policy == slow_policy::disconnect)
+            disconnect();
+
+        // фрагменты не склеиваются, сообщение отбрасывается целиком
+        if ((rc != verdict::write) && !fin)
+            rc = verdict::drop;
+        skip_fragments_ = !fin && (rc == verdict::drop);
+        fragmenting_ = !fin && (rc == verdict::write);
+        if (rc == verdict::coalesce)
+            coalesced_.drain(coalesced_.size());
+        return rc;
+    }
+
+    // фрагментированные сообщения уходят без сжатия
+    bool compressible(opcode op, bool fin, std::size_t len) const noexcept
+    {
+        return deflate_ && fin && !is_control(op) &&
+            (op != opcode::continuation) && deflate_->use(len);
+    }
+
+    void fail(std::uint16_t code)
+    {
+        if (!close_sent_)
+            send_close(code, {});
+        close_received_ = true;
+        bev_.disable(EV_READ);
+        ws_.on_event(BEV_EVENT_READING|BEV_EVENT_ERROR);
+    }
+
+    bool validate(const frame_header& h)
+    {
+        auto code = close_code::protocol_error;
+        // rsv1 только у первого кадра сообщения и при согласованном deflate
+        auto rsv1 = !h.rsv1 || (deflate_ && !is_control(h.op) &&
+            (h.op != opcode::continuation));
+        auto valid = is_known(h.op) && rsv1 && !(h.rsv2 || h.rsv3) &&
+            (h.masked == (role_ == role::server));
+
+        if (valid)
+        {
+            if (is_control(h.op))
+                valid = h.fin && (h.length <= max_control_payload);
+            else if (h.op == opcode::continuation)
+                valid = message_op_ != opcode::continuation;
+            else
+                valid = message_op_ == opcode::continuation;
+        }
+
+        // при потоковом приеме фрагменты не копятся в message_
+        auto received = message_.size();
+        if (streaming_)
+            received = (h.op == opcode::continuation) ? message_size_ : 0;
+        if (valid && !is_control(h.op) &&
+            (h.length > max_message_size_ - received))
+        {
+            code = close_code::too_big;
+            valid = false;
+        }
+
+        if (!valid)
+            fail(code);
+
+        return valid;
+    }
+
+    // распаковывает len байт из src в message_
+    bool inflate(e4pp::evbufer_ptr src, std::size_t len)
+    {
+        if (deflate_->decompress(src, len, message_.handle(),
+            max_message_size_))
+            return true;
+
+        auto code = (message_.size() > max_message_size_) ?
+            close_code::too_big : close_code::invalid_payload;
+        message_.drain(message_.size());
+        fail(code);
+        return false;
+    }
+
+    void deliver(opcode op, e4pp::buffer_ref buf, std::size_t len)
+    {
+        const char* ptr = "";
+        if (len)
+            ptr = reinterpret_cast<const char*>(buf.pullup(
+                static_cast<ev_ssize_t>(len)));
+        ws_.message(op, ptr, len);
+        buf.drain(len);
+    }
+
+    // @return false если дальше читать не нужно
+    bool dispatch(const frame_header& h, e4pp::buffer_ref input)
+    {
+        auto len = static_cast<std::size_t>(h.length);
+        if (is_control(h.op))
+        {
+            char payload[max_control_payload];
+            if (len)
+                input.copyout(payload, len);
+            input.drain(len);
+
+            if (h.op == opcode::ping)
+            {
+                if (!close_sent_)
+                {
+                    auto output = bev_.output();
+                    write_frame(output, make_header(opcode::pong, true),
+                        payload, len);
+                }
+                if constexpr (requires { ws_.on_ping(payload, len); })
+                    ws_.on_ping(payload, len);
+            }
+            else if (h.op == opcode::pong)
+            {
+                if constexpr (requires { ws_.on_pong(payload, len); })
+                    ws_.on_pong(payload, len);
+            }
+            else
+            {
+                std::uint16_t code = 0;
+                std::string_view reason;
+                if (len >= 2)
+                {
+                    code = static_cast<std::uint16_t>(
+                        (static_cast<unsigned char>(payload[0]) << 8) |
+                        static_cast<unsigned char>(payload[1]));
+                    reason = std::string_view{payload + 2, len - 2};
+                }
+                else if (len == 1)
+                {
+                    fail(close_code::protocol_error);
+                    return false;
+                }
+
+                close_received_ = true;
+                if (!close_sent_)
+                    send_close(code ? code : close_code::normal, {});
+                if constexpr (requires { ws_.on_close(code, reason); })
+                    ws_.on_close(code, reason);
+                finish_close();
+                return false;
+            }
+            return true;
+        }
+
+        if (h.fin && (message_op_ == opcode::continuation))
+        {
+            if (h.rsv1)
+            {
+                if (!inflate(input.handle(), len))
+                    return false;
+                deliver(h.op, e4pp::buffer_ref{message_.handle()},
+                    message_.size());
+                return true;
+            }
+
+            // целое сообщение, обычно лежит в одном сегменте
+            deliver(h.op, input, len);
+            return true;
+        }
+
+        if (h.op != opcode::continuation)
+        {
+            message_op_ = h.op;
+            message_compressed_ = h.rsv1;
+        }
+
+        if (len)
+        {
+            e4pp::detail::check_result("evbuffer_remove_buffer",
+                evbuffer_remove_buffer(input.handle(),
+                    message_.handle(), len));
+        }
+
+        if (h.fin)
+        {
+            auto op = std::exchange(message_op_, opcode::continuation);
+            if (std::exchange(message_compressed_, false) &&
+                !inflate(message_.handle(), message_.size()))
+                return false;
+            deliver(op, e4pp::buffer_ref{message_.handle()}, message_.size());
+        }
+
+        return true;
+    }
+
+    // отдает len байт buf сегментами без pullup
+    void emit(e4pp::evbufer_ptr buf, std::size_t len, bool fin)
+    {
+        if constexpr (streaming_socket<T>)
+        {
+            message_size_ += len;
+            if (!len)
+            {
+                if (fin)
+                    ws_.message(stream_op_, "", 0, true);
+                return;
+            }
+
+            constexpr int max_vec = 16;
+            evbuffer_iovec vec[max_vec];
+            while (len)
+            {
+                auto n = evbuffer_peek(buf,
+                    static_cast<ev_ssize_t>(len), nullptr, vec, max_vec);
+                if (n <= 0)
+                    break;
+
+                std::size_t done = 0;
+                for (int i = 0; (i < n) && (i < max_vec) && len; ++i)
+                {
+                    auto part = (std::min)(vec[i].iov_len, len);
+                    len -= part;
+                    done += part;
+                    ws_.message(stream_op_,
+                        static_cast<const char*>(vec[i].iov_base),
+                        part, fin && !len);
+                }
+                evbuffer_drain(buf, done);
+            }
+        }
+        else
+        {
+            (void)buf;
+            (void)len;
+            (void)fin;
+            assert(false);
+        }
+    }
+
+    void begin_frame(const frame_header& h)
+    {
+        if (h.op != opcode::continuation)
+        {
+            stream_op_ = h.op;
+            message_compressed_ = h.rsv1;
+            message_size_ = 0;
+        }
+        // продолжение сообщения ожидается после кадра без fin
+        message_op_ = h.fin ? opcode::continuation : stream_op_;
+        frame_ = h;
+        frame_left_ = h.length;
+        frame_offset_ = 0;
+        in_frame_ = true;
+    }
+
+    // @return false если дальше читать не нужно
+    bool stream_payload(e4pp::buffer_ref input)
+    {
+        auto len = static_cast<std::size_t>((std::min)(
+            static_cast<std::uint64_t>(input.size()), frame_left_));
+        if (!len && frame_left_)
+            return true;
+
+        if (frame_.masked && len)
+            frame_offset_ = mask(input.handle(), len,
+                frame_.mask, frame_offset_);
+
+        frame_left_ -= len;
+        in_frame_ = frame_left_ != 0;
+        auto fin = frame_.fin && !in_frame_;
+        if (!message_compressed_)
+        {
+            emit(input.handle(), len, fin);
+            return true;
+        }
+
+        if (!deflate_->decompress(input.handle(), len, message_.handle(),
+            max_message_size_ - message_size_, fin))
+        {
+            auto code = (message_.size() > max_message_size_ - message_size_) ?
+                close_code::too_big : close_code::invalid_payload;
+            message_.drain(message_.size());
+            fail(code);
+            return false;
+        }
+
+        emit(message_.handle(), message_.size(), fin);
+        if (fin)
+            message_compressed_ = false;
+        return true;
+    }
+
+    void event_read()
+    {
+        auto input = bev_.input();
+        while (!close_received_)
+        {
+            if (in_frame_)
+            {
+                if (!stream_payload(input))
+                    return;
+                if (in_frame_)
+                    break;
+                continue;
+            }
+
+            unsigned char raw[max_header_size];
+            auto avail = input.size();
+            if (avail < 2)
+                break;
+
+            frame_header h;
+            auto hsize = parse_header(raw,
+                input.copyout(raw, (std::min)(avail, max_header_size)), h);
+            if (!hsize)
+                break;
+
+            if (!validate(h))
+                return;
+
+            if (streaming_ && !is_control(h.op))
+            {
+                // payload не ждем, он отдается частями
+                input.drain(hsize);
+                begin_frame(h);
+                continue;
+            }
+
+            auto total = hsize + static_cast<std::size_t>(h.length);
+            if (avail < total)
+            {
+                // не будим разбор пока кадр не придет целиком
+                bev_.set_watermark(EV_READ, total, 0);
+                watermark_ = true;
+                return;
+            }
+
+            if (watermark_)
+            {
+                bev_.set_watermark(EV_READ, 0, 0);
+                watermark_ = false;
+            }
+
+            input.drain(hsize);
+            if (h.masked && h.length)
+                mask(input.handle(), total - hsize, h.mask);
+
+            if (!dispatch(h, input))
+                return;
+        }
+
+        if (close_received_ && !input.empty())
+            input.drain(input.size());
+    }
+
+    void event_write()
+    {
+        auto output = bev_.output();
+        if (!disconnected_ && congestion_.drained(output.size()))
+        {
+            if (!close_sent_ && !coalesced_.empty())
+            {
+                e4pp::detail::check_result("evbuffer_add_buffer",
+                    evbuffer_add_buffer(output.handle(),
+                        coalesced_.handle()));
+            }
+            if constexpr (requires { ws_.on_writable(); })
+                ws_.on_writable();
+        }
+
+        if (closing_ && bev_.output().empty())
+        {
+            closing_ = false;
+            ws_.on_event(BEV_EVENT_EOF);
+        }
+    }
+
+    static void readcb(bufferevent*, void *user_data)
+    {
+        assert(user_data);
+        static_cast<this_type*>(user_data)->event_read();
+    }
+
+    static void writecb(bufferevent*, void *user_data)
+    {
+        assert(user_data);
+        static_cast<this_type*>(user_data)->event_write();
+    }
+
+    static void eventcb(bufferevent*, short what, void *user_data)
+    {
+        assert(user_data);
+        static_cast<this_type*>(user_data)->ws_.on_event(what);
+    }
+
+public:
+    engine(socket_type& ws, role r = role::client) noexcept
+        : ws_{ws}
+        , role_{r}
+    {   }
+
+    engine(const engine&) = delete;
+    engine& operator=(const engine&) = delete;
+
+    // bufferevent после http upgrade, уже прочитанные кадры
+    // разбираются сразу
+    void setup(bufferevent* b)
+    {
+        assert(b);
+        bev_ = e4pp::buffer_event_ref{b};
+        bev_.set(readcb, writecb, eventcb, this);
+        if (congestion_.options().high)
+            bev_.set_watermark(EV_WRITE, congestion_.options().low, 0);
+        bev_.enable(EV_READ|EV_WRITE);
+        if (!bev_.input().empty())
+            event_read();
+    }
+
+    bufferevent* handle() const noexcept
+    {
+        return bev_.handle();
+    }
+
+    role get_role() const noexcept
+    {
+        return role_;
+    }
+
+    // результат согласования permessage-deflate, до setup
+    void set_deflate(const permessage_deflate& p)
+    {
+        if (p.enabled)
+            deflate_ = std::make_unique<deflate_codec>(p,
+                role_ == role::server);
+        else
+            deflate_.reset();
+    }
+
+    bool deflate() const noexcept
+    {
+        return static_cast<bool>(deflate_);
+    }
+
+    // сообщения отдаются в message(op, ptr, len, fin) частями по мере
+    // прихода, без сборки в памяти, последняя часть может быть пустой
+    // max_message_size ограничивает сообщение целиком
+    void set_streaming(bool on) noexcept
+        requires streaming_socket<T>
+    {
+        assert(!in_frame_ && message_.empty());
+        streaming_ = on;
+    }
+
+    bool streaming() const noexcept
+    {
+        return streaming_;
+    }
+
+    // пределы вывода и политика для медленного получателя
+    void set_backpressure(const backpressure_options& options)
+    {
+        assert(!options.high || (options.low < options.high));
+        congestion_ = congestion{options};
+        if (bev_)
+            bev_.set_watermark(EV_WRITE, options.low, 0);
+    }
+
+    const backpressure_options& backpressure() const noexcept
+    {
+        return congestion_.options();
+    }
+
+    // примет ли сессия следующее сообщение без политики
+    bool writable() const noexcept
+    {
+        auto high = congestion_.options().high;
+        return !disconnected_ && !close_sent_ && !(high &&
+            (congestion_.congested() || (bev_.output().size() >= high)));
+    }
+
+    // ограничение на сообщение целиком, включая все фрагменты
+    void set_max_message_size(std::size_t size) noexcept
+    {
+        max_message_size_ = size;
+    }
+
+    std::size_t max_message_size() const noexcept
+    {
+        return max_message_size_;
+    }
+
+    // @return false если сообщение отброшено политикой
+    // при coalesce сообщение ждет освобождения вывода и уходит без сжатия
+    bool send(opcode op, const void* data, std::size_t len, bool fin = true)
+    {
+        assert(!close_sent_);
+        auto v = admit(op, fin);
+        if (v == verdict::drop)
+            return false;
+
+        auto h = make_header(op, fin);
+        if (v == verdict::coalesce)
+        {
+            write_frame(coalesced_, h, data, len);
+            return true;
+        }
+
+        auto output = bev_.output();
+        if (compressible(op, fin, len) &&
+            deflate_->compress(data, len, deflated_.handle()))
+        {
+            h.rsv1 = true;
+            write_frame(output, h, deflated_);
+        }
+        else
+            write_frame(output, h, data, len);
+        return true;
+    }
+
+    bool send(opcode op, std::string_view data, bool fin = true)
+    {
+        return send(op, data.data(), data.size(), fin);
+    }
+
+    // payload переносится в выходной буфер без копирования
+    template<class A>
+    bool send(opcode op, e4pp::basic_buffer<A>& payload, bool fin = true)
+    {
+        assert(!close_sent_);
+        auto v = admit(op, fin);
+        if (v == verdict::drop)
+            return false;
+
+        auto h = make_header(op, fin);
+        if (v == verdict::coalesce)
+        {
+            write_frame(coalesced_, h, payload);
+            return true;
+        }
+
+        auto output = bev_.output();
+        if (compressible(op, fin, payload.size()))
+        {
+            if (!deflate_->compress(payload.handle(), deflated_.handle()))
+                throw std::runtime_error("deflate");
+            h.rsv1 = true;
+            write_frame(output, h, deflated_);
+        }
+        else
+            write_frame(output, h, payload);
+        return true;
+    }
+
+    // готовый серверный кадр, например от hub
+    // добавляется ссылкой на цепочки frame без копирования
+    // кадр должен быть целым сообщением данных
+    // пока не ушел последний фрагмент send(..., false) кадр не принимается
+    bool send_shared(e4pp::evbufer_ptr frame)
+    {
+        assert(frame && (role_ == role::server));
+        if (close_sent_ || fragmenting_)
+            return false;
+
+        auto v = admit(opcode::binary, true);
+        if (v == verdict::drop)
+            return false;
+
+        auto out = (v == verdict::coalesce) ?
+            coalesced_.handle() : bev_.output().handle();
+        e4pp::detail::check_result("evbuffer_add_buffer_reference",
+            evbuffer_add_buffer_reference(out, frame));
+        return true;
+    }
+
+    bool send_text(std::string_view text)
+    {
+        return send(opcode::text, text);
+    }
+
+    bool send_binary(const void* data, std::size_t len)
+    {
+        return send(opcode::binary, data, len);
+    }
+
+    void ping(std::string_view payload = {})
+    {
+        assert(payload.size() <= max_control_payload);
+        send(opcode::ping, payload);
+    }
+
+    // начинает close handshake, on_event(BEV_EVENT_EOF) придет
+    // после ответного close
+    void close(std::uint16_t code = close_code::normal,
+        std::string_view reason = {})
+    {
+        if (!close_sent_)
+            send_close(code, reason);
+    }
+
+    bool close_sent() const noexcept
+    {
+        return close_sent_;
+    }
+
+    bool close_received() const noexcept
+    {
+        return close_received_;
+    }
+};
+
+} // namespace ws
+} // namespace http
+} // namespace e4ppx
@@ -2,6 +2,9 @@
 
 #include "e4ppx/ssl/rand.hpp"
 #include "e4pp/buffer_event.hpp"
+#include "e4ppx/http/ws/deflate.hpp"
+#include "e4ppx/http/ws/backpressure.hpp"
+#include "e4pp/evtype.hpp"
 #include <wslay/wslay.h>
 
 namespace e4ppx {
@@ -21,6 +24,14 @@ struct wslay_free
 
 } // namespace detail
 
+// сокет принимающий сообщение wslay частями
+template<class T>
+concept wslay_streaming_socket = requires(T& t, const char* ptr,
+    std::size_t len)
+{
+    t.message(WSLAY_TEXT_FRAME, ptr, len, true);
+};
+
 // класс адаптера для wslay
 template<class T>
 struct evwslay {
@@ -29,6 +40,29 @@ struct evwslay {
 
     socket_type& ws;
     bufferevent* bev{nullptr};
+    // permessage-deflate после согласования, см. set_deflate
+    std::unique_ptr<deflate_codec> deflate{};
+    e4pp::buffer deflated{};
+    std::size_t max_message_size{16 * 1024 * 1024};
+    // потоковый прием через frame_recv_start/chunk/end, см. set_streaming
+    bool streaming{};
+    bool frame_data{};
+    bool frame_fin{};
+    bool stream_compressed{};
+    uint8_t stream_op{};
+    // распаковано из текущего сжатого сообщения
+    std::size_t streamed{};
+    // сообщение отвергнуто, остаток до close не отдается
+    bool stream_failed{};
+    // медленный получатель, см. set_backpressure
+    congestion backlog{};
+    std::string coalesced{};
+    wslay_opcode coalesced_op{};
+    bool has_coalesced{};
+    bool disconnected{};
+    // отправка и bufferevent_enable один раз за итерацию цикла
+    e4pp::heap_event update_ev{};
+    bool update_pending{};
 
     static wslay_event_context_ptr create_client_wslay(this_type& op) {
         auto cb = wslay_event_callbacks{
@@ -36,18 +70,20 @@ struct evwslay {
             this_type::send_cb,
             [](wslay_event_context_ptr ctx, 
                 uint8_t *buf, size_t len, void*) {
-                e4ppx::openssl::rand rnd;
-                rnd(buf, len);
-                return int{};
+                return e4ppx::openssl::rand_pool::local().fill(buf, len) ?
+                    0 : -1;
             },
-            nullptr, /* on_frame_recv_start_callback */
-            nullptr, /* on_frame_recv_callback */
-            nullptr, /* on_frame_recv_end_callback */
+            this_type::on_frame_recv_start_cb,
+            this_type::on_frame_recv_chunk_cb,
+            this_type::on_frame_recv_end_cb,
             this_type::on_msg_recv_cb,
         };
 
         wslay_event_context_ptr rc = nullptr;
-        wslay_event_context_client_init(&rc, &cb, &rc);
+        wslay_event_context_client_init(&rc, &cb, &op);
+        if (rc)
+            wslay_event_config_set_max_recv_msg_length(rc,
+                op.max_message_size);
         return rc;
     }
 
@@ -65,19 +101,227 @@ struct evwslay {
         assert(bev);
         auto buf = e4pp::buffer_ref{
             bufferevent_get_output(e4pp::assert_handle(bev))};
+        // выше high кадры остаются в очереди wslay до writecb
+        auto high = backlog.options().high;
+        if (high && (buf.size() >= high)) {
+            wslay_event_set_error(wslay.get(), WSLAY_ERR_WOULDBLOCK);
+            return -1;
+        }
         buf.append(data, len);
-        io_update();
         return len;
     }
     void setup(bufferevent* b) {
         assert(b);
         bufferevent_setcb(b, this_type::readcb, 
             this_type::writecb, this_type::eventcb, this);
+        if (backlog.options().high)
+            bufferevent_setwatermark(b, EV_WRITE, backlog.options().low, 0);
+        update_ev.destroy();
+        update_ev.create(bufferevent_get_base(b), -1, e4pp::ev_timeout,
+            this_type::updatecb, this);
         bev = b;
     }
-    void forward_msg(wslay_opcode opcode, const uint8_t *ptr, std::size_t len) {
+    // пределы вывода и политика для медленного получателя
+    void set_backpressure(const backpressure_options& options) {
+        assert(!options.high || (options.low < options.high));
+        backlog = congestion{options};
+        if (bev)
+            bufferevent_setwatermark(bev, EV_WRITE, options.low, 0);
+    }
+    // вывод bufferevent и очередь wslay
+    std::size_t pending() const {
+        auto rc = wslay_event_get_queued_msg_length(wslay.get());
+        if (bev)
+            rc += evbuffer_get_length(bufferevent_get_output(bev));
+        return rc;
+    }
+    bool writable() const {
+        auto high = backlog.options().high;
+        return !disconnected &&
+            !(high && (backlog.congested() || (pending() >= high)));
+    }
+    void disconnect() {
+        disconnected = true;
+        has_coalesced = false;
+        coalesced.clear();
+        bufferevent_disable(bev, EV_READ);
+        // событие придет из цикла, владелец может удалить сессию
+        bufferevent_trigger_event(bev, BEV_EVENT_WRITING|BEV_EVENT_ERROR,
+            BEV_TRIG_DEFER_CALLBACKS);
+    }
+    void schedule_update() {
+        if (!update_pending && !update_ev.empty()) {
+            update_pending = true;
+            event_active(update_ev, EV_TIMEOUT, 0);
+        }
+    }
+    // результат permessage_deflate::accept для ответа сервера
+    void set_deflate(const permessage_deflate& p) {
+        if (p.enabled) {
+            deflate = std::make_unique<deflate_codec>(p, false);
+            wslay_event_config_set_allowed_rsv_bits(wslay.get(),
+                WSLAY_RSV1_BIT);
+        } else {
+            deflate.reset();
+            wslay_event_config_set_allowed_rsv_bits(wslay.get(),
+                WSLAY_RSV_NONE);
+        }
+    }
+    // предел сообщения, wslay закрывает соединение с 1009
+    void set_max_message_size(std::size_t size) {
+        max_message_size = size;
+        wslay_event_config_set_max_recv_msg_length(wslay.get(), size);
+    }
+    // сообщения данных отдаются в message(op, ptr, len, fin) по мере
+    // прихода без сборки в wslay, последняя часть может быть пустой
+    void set_streaming(bool on) requires wslay_streaming_socket<T> {
+        streaming = on;
+        wslay_event_config_set_no_buffering(wslay.get(), on ? 1 : 0);
+    }
+    void forward_chunk(const uint8_t *ptr, std::size_t len, bool fin) {
+        if constexpr (wslay_streaming_socket<T>) {
+            auto op = static_cast<wslay_opcode>(stream_op);
+            if (stream_failed)
+                return;
+            if (!stream_compressed) {
+                if (len || fin)
+                    ws.message(op, len ? reinterpret_cast<const char*>(ptr) :
+                        "", len, fin);
+                return;
+            }
+            e4pp::buffer src;
+            if (len) {
+                e4pp::detail::check_result("evbuffer_add_reference",
+                    evbuffer_add_reference(src.handle(),
+                        ptr, len, nullptr, nullptr));
+            }
+            // предел на сообщение целиком, а не на часть
+            auto limit = max_message_size - streamed;
+            if (!deflate->decompress(src.handle(), len,
+                deflated.handle(), limit, fin)) {
+                auto code = (deflated.size() > limit) ?
+                    close_code::too_big : close_code::invalid_payload;
+                deflated.drain(deflated.size());
+                stream_failed = true;
+                wslay_event_queue_close(wslay.get(), code, nullptr, 0);
+                schedule_update();
+                return;
+            }
+            len = deflated.size();
+            streamed += len;
+            ptr = len ? static_cast<const uint8_t*>(deflated.pullup(-1)) :
+                reinterpret_cast<const uint8_t*>("");
+            if (len || fin)
+                ws.message(op, reinterpret_cast<const char*>(ptr), len, fin);
+            deflated.drain(len);
+            if (fin)
+                stream_compressed = false;
+        } else {
+            (void)ptr;
+            (void)len;
+            (void)fin;
+        }
+    }
+    static void on_frame_recv_start_cb(wslay_event_context_ptr,
+        const struct wslay_event_on_frame_recv_start_arg *arg,
+        void *user_data) {
+        assert(user_data);
+        auto a = static_cast<this_type*>(user_data);
+        // управляющие кадры wslay обрабатывает сам
+        a->frame_data = a->streaming && !(arg->opcode & 0x8);
+        if (!a->frame_data)
+            return;
+        a->frame_fin = arg->fin != 0;
+        if (arg->opcode != WSLAY_CONTINUATION_FRAME) {
+            a->stream_op = arg->opcode;
+            a->stream_compressed = (arg->rsv & WSLAY_RSV1_BIT) && a->deflate;
+            a->streamed = 0;
+            a->stream_failed = false;
+        }
+    }
+    static void on_frame_recv_chunk_cb(wslay_event_context_ptr,
+        const struct wslay_event_on_frame_recv_chunk_arg *arg,
+        void *user_data) {
+        assert(user_data);
+        auto a = static_cast<this_type*>(user_data);
+        if (a->frame_data && arg->data_length)
+            a->forward_chunk(arg->data, arg->data_length, false);
+    }
+    static void on_frame_recv_end_cb(wslay_event_context_ptr,
+        void *user_data) {
+        assert(user_data);
+        auto a = static_cast<this_type*>(user_data);
+        if (a->frame_data && a->frame_fin)
+            a->forward_chunk(nullptr, 0, true);
+        a->frame_data = false;
+    }
+    // @return false если сообщение отброшено политикой
+    bool send(wslay_opcode opcode, const void* data, std::size_t len) {
+        if (disconnected)
+            return false;
+        if (!(opcode & 0x8) && !backlog.admit(pending())) {
+            switch (backlog.options().policy) {
+            case slow_policy::coalesce:
+                coalesced_op = opcode;
+                coalesced.assign(static_cast<const char*>(data), len);
+                has_coalesced = true;
+                return true;
+            case slow_policy::disconnect:
+                disconnect();
+                return false;
+            default:
+                return false;
+            }
+        }
+        auto rsv = static_cast<uint8_t>(WSLAY_RSV_NONE);
+        if (deflate && deflate->use(len) &&
+            deflate->compress(data, len, deflated.handle())) {
+            rsv = WSLAY_RSV1_BIT;
+            len = deflated.size();
+            data = len ? deflated.pullup(-1) : nullptr;
+        }
+        // wslay копирует сообщение в свою очередь
+        auto msg = wslay_event_msg{static_cast<uint8_t>(opcode),
+            static_cast<const uint8_t*>(data), len};
+        auto rc = wslay_event_queue_msg_ex(wslay.get(), &msg, rsv);
+        deflated.drain(deflated.size());
+        if (rc != 0)
+            throw std::runtime_error("wslay_event_queue_msg_ex");
+        schedule_update();
+        return true;
+    }
+    void forward_msg(wslay_opcode opcode, uint8_t rsv,
+        const uint8_t *ptr, std::size_t len) {
+        // при потоковом приеме данные уже отданы частями
+        if (streaming && !(opcode & 0x8))
+            return;
+        if (rsv & WSLAY_RSV1_BIT) {
+            assert(deflate);
+            e4pp::buffer src;
+            if (len) {
+                e4pp::detail::check_result("evbuffer_add_reference",
+                    evbuffer_add_reference(src.handle(),
+                        ptr, len, nullptr, nullptr));
+            }
+            if (!deflate->decompress(src.handle(), len,
+                deflated.handle(), max_message_size)) {
+                auto code = (deflated.size() > max_message_size) ?
+                    close_code::too_big : close_code::invalid_payload;
+                deflated.drain(deflated.size());
+                wslay_event_queue_close(wslay.get(), code, nullptr, 0);
+                schedule_update();
+                return;
+            }
+            len = deflated.size();
+            ptr = len ? static_cast<const uint8_t*>(deflated.pullup(-1)) :
+                reinterpret_cast<const uint8_t*>("");
+            ws.message(opcode, reinterpret_cast<const char*>(ptr), len);
+            deflated.drain(deflated.size());
+            schedule_update();
+            return;
+        }
         ws.message(opcode, reinterpret_cast<const char*>(ptr), len);
-        io_update();
+        schedule_update();
     }
     static ssize_t recv_cb(wslay_event_context_ptr ctx,
         uint8_t *data, size_t len, int flags, void *user_data) {
@@ -94,14 +338,31 @@ struct evwslay {
         const struct wslay_event_on_msg_recv_arg *arg, void *user_data) {
         assert(user_data);
         static_cast<this_type*>(user_data)->forward_msg(
-            static_cast<wslay_opcode>(arg->opcode),
+            static_cast<wslay_opcode>(arg->opcode), arg->rsv,
                 arg->msg, arg->msg_length);
     }
     void event_read() {
-        wslay_event_recv(wslay);
+        wslay_event_recv(wslay.get());
+        // ответы на ping и close
+        schedule_update();
     }
     void event_write() {
-        wslay_event_send(wslay);
+        wslay_event_send(wslay.get());
+        if (!disconnected && backlog.drained(pending())) {
+            if (has_coalesced) {
+                has_coalesced = false;
+                auto msg = std::move(coalesced);
+                send(coalesced_op, msg.data(), msg.size());
+            }
+            if constexpr (requires { ws.on_writable(); })
+                ws.on_writable();
+        }
+        io_update();
+    }
+    void event_update() {
+        update_pending = false;
+        wslay_event_send(wslay.get());
+        io_update();
     }
     void event_network(short what) {
         ws.on_event(what);
@@ -114,14 +375,18 @@ struct evwslay {
         assert(user_data);
         static_cast<this_type*>(user_data)->event_write();             
     }
+    static void updatecb(evutil_socket_t, short, void *user_data) {
+        assert(user_data);
+        static_cast<this_type*>(user_data)->event_update();
+    }
     static void eventcb(bufferevent*, short what, void *user_data) {
         assert(user_data);
         static_cast<this_type*>(user_data)->event_network(what);    
     }
     void io_update() {
         assert(bev);
-        short ev = wslay_event_want_read(wslay) ? EV_READ : 0;
-            ev |= wslay_event_want_write(wslay) ? EV_WRITE : 0;
+        short ev = wslay_event_want_read(wslay.get()) ? EV_READ : 0;
+            ev |= wslay_event_want_write(wslay.get()) ? EV_WRITE : 0;
         if (ev) {
             bufferevent_enable(bev, ev);
         } else {
@@ -0,0 +1,365 @@
+#pragma once
+
+#include "e4pp/buffer.hpp"
+#include "e4pp/simd.hpp"
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+// кадры websocket (RFC 6455) поверх цепочек evbuffer
+// без внешних зависимостей, маскирование через SIMD
+
+namespace e4ppx {
+namespace http {
+namespace ws {
+
+enum class opcode : std::uint8_t
+{
+    continuation = 0x0,
+    text = 0x1,
+    binary = 0x2,
+    close = 0x8,
+    ping = 0x9,
+    pong = 0xa
+};
+
+constexpr bool is_control(opcode op) noexcept
+{
+    return (static_cast<std::uint8_t>(op) & 0x8) != 0;
+}
+
+constexpr bool is_known(opcode op) noexcept
+{
+    switch (op)
+    {
+    case opcode::continuation:
+    case opcode::text:
+    case opcode::binary:
+    case opcode::close:
+    case opcode::ping:
+    case opcode::pong:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// коды закрытия
+namespace close_code {
+
+static constexpr std::uint16_t normal = 1000;
+static constexpr std::uint16_t going_away = 1001;
+static constexpr std::uint16_t protocol_error = 1002;
+static constexpr std::uint16_t unsupported = 1003;
+static constexpr std::uint16_t invalid_payload = 1007;
+static constexpr std::uint16_t policy = 1008;
+static constexpr std::uint16_t too_big = 1009;
+static constexpr std::uint16_t internal_error = 1011;
+
+} // namespace close_code
+
+using mask_key = std::array<unsigned char, 4>;
+
+struct frame_header
+{
+    bool fin{true};
+    // rsv1 - per-message compressed
+    bool rsv1{};
+    bool rsv2{};
+    bool rsv3{};
+    opcode op{opcode::binary};
+    bool masked{};
+    mask_key mask{};
+    std::uint64_t length{};
+};
+
+static constexpr std::size_t max_header_size = 14;
+static constexpr std::size_t max_control_payload = 125;
+
+constexpr std::size_t header_size(std::uint64_t length, bool masked) noexcept
+{
+    std::size_t rc = 2;
+    if (length > 0xffff)
+        rc += 8;
+    else if (length > 125)
+        rc += 2;
+    return masked ? rc + 4 : rc;
+}
+
+// out должен вмещать header_size(h.length, h.masked)
+// @return размер заголовка
+inline std::size_t encode_header(unsigned char* out,
+    const frame_header& h) noexcept
+{
+    out[0] = static_cast<unsigned char>((h.fin ? 0x80 : 0) |
+        (h.rsv1 ? 0x40 : 0) | (h.rsv2 ? 0x20 : 0) | (h.rsv3 ? 0x10 : 0) |
+        static_cast<std::uint8_t>(h.op));
+
+    auto mask_bit = static_cast<unsigned char>(h.masked ? 0x80 : 0);
+    std::size_t pos = 2;
+    if (h.length > 0xffff)
+    {
+        out[1] = mask_bit | 127;
+        for (int i = 7; i >= 0; --i)
+            out[pos++] = static_cast<unsigned char>(h.length >> (i * 8));
+    }
+    else if (h.length > 125)
+    {
+        out[1] = mask_bit | 126;
+        out[pos++] = static_cast<unsigned char>(h.length >> 8);
+        out[pos++] = static_cast<unsigned char>(h.length);
+    }
+    else
+        out[1] = mask_bit | static_cast<unsigned char>(h.length);
+
+    if (h.masked)
+    {
+        std::memcpy(out + pos, h.mask.data(), h.mask.size());
+        pos += h.mask.size();
+    }
+
+    return pos;
+}
+
+// @return размер заголовка или 0 если данных пока не хватает
+inline std::size_t parse_header(const unsigned char* in,
+    std::size_t len, frame_header& h) noexcept
+{
+    if (len < 2)
+        return 0;
+
+    h.fin = (in[0] & 0x80) != 0;
+    h.rsv1 = (in[0] & 0x40) != 0;
+    h.rsv2 = (in[0] & 0x20) != 0;
+    h.rsv3 = (in[0] & 0x10) != 0;
+    h.op = static_cast<opcode>(in[0] & 0x0f);
+    h.masked = (in[1] & 0x80) != 0;
+
+    std::size_t pos = 2;
+    std::uint64_t length = in[1] & 0x7f;
+    if (length == 126)
+    {
+        if (len < 4)
+            return 0;
+        length = (std::uint64_t{in[2]} << 8) | in[3];
+        pos = 4;
+    }
+    else if (length == 127)
+    {
+        if (len < 10)
+            return 0;
+        length = 0;
+        for (std::size_t i = 2; i < 10; ++i)
+            length = (length << 8) | in[i];
+        pos = 10;
+    }
+    h.length = length;
+
+    if (h.masked)
+    {
+        if (len < pos + 4)
+            return 0;
+        std::memcpy(h.mask.data(), in + pos, 4);
+        pos += 4;
+    }
+
+    return pos;
+}
+
+namespace detail {
+
+#ifdef E4PP_SIMD_X86
+
+__attribute__((target("sse2")))
+inline void mask_sse2(unsigned char*& p, std::size_t& len,
+    std::uint32_t pattern) noexcept
+{
+    auto m = _mm_set1_epi32(static_cast<int>(pattern));
+    for (; len >= 16; len -= 16, p += 16)
+    {
+        auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(p), _mm_xor_si128(v, m));
+    }
+}
+
+__attribute__((target("avx2")))
+inline void mask_avx2(unsigned char*& p, std::size_t& len,
+    std::uint32_t pattern) noexcept
+{
+    auto m = _mm256_set1_epi32(static_cast<int>(pattern));
+    for (; len >= 64; len -= 64, p += 64)
+    {
+        auto a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        auto b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(p),
+            _mm256_xor_si256(a, m));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(p + 32),
+            _mm256_xor_si256(b, m));
+    }
+    for (; len >= 32; len -= 32, p += 32)
+    {
+        auto a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(p),
+            _mm256_xor_si256(a, m));
+    }
+}
+
+#endif // E4PP_SIMD_X86
+
+} // namespace detail
+
+// xor с ключом на месте, offset - позиция data внутри payload
+// @return offset для следующего куска
+inline std::size_t mask(void* data, std::size_t len,
+    const mask_key& key, std::size_t offset = 0) noexcept
+{
+    auto p = static_cast<unsigned char*>(data);
+
+    // ключ сдвинутый на текущую позицию, дальше блоки кратны 4
+    unsigned char rot[4];
+    for (std::size_t i = 0; i < 4; ++i)
+        rot[i] = key[(offset + i) & 3];
+    std::uint32_t pattern;
+    std::memcpy(&pattern, rot, sizeof(pattern));
+    offset += len;
+
+#ifdef E4PP_SIMD_X86
+    auto level = e4pp::simd::current();
+    if (level == e4pp::simd::level::avx2)
+        detail::mask_avx2(p, len, pattern);
+    if (level >= e4pp::simd::level::sse2)
+        detail::mask_sse2(p, len, pattern);
+#endif // E4PP_SIMD_X86
+
+    std::uint64_t wide = (std::uint64_t{pattern} << 32) | pattern;
+    for (; len >= 8; len -= 8, p += 8)
+    {
+        std::uint64_t v;
+        std::memcpy(&v, p, sizeof(v));
+        v ^= wide;
+        std::memcpy(p, &v, sizeof(v));
+    }
+
+    for (std::size_t i = 0; i < len; ++i)
+        p[i] ^= rot[i & 3];
+
+    return offset;
+}
+
+// маскирует первые len байт цепочки на месте, по сегментам
+// @return offset для продолжения payload
+inline std::size_t mask(e4pp::evbufer_ptr buf, std::size_t len,
+    const mask_key& key, std::size_t offset = 0) noexcept
+{
+    assert(buf);
+
+    evbuffer_ptr pos;
+    evbuffer_ptr_set(buf, &pos, 0, EVBUFFER_PTR_SET);
+
+    constexpr int max_vec = 16;
+    evbuffer_iovec vec[max_vec];
+    while (len)
+    {
+        auto n = evbuffer_peek(buf,
+            static_cast<ev_ssize_t>(len), &pos, vec, max_vec);
+        if (n <= 0)
+            break;
+
+        std::size_t done = 0;
+        for (int i = 0; (i < n) && (i < max_vec) && len; ++i)
+        {
+            auto part = (std::min)(vec[i].iov_len, len);
+            offset = mask(vec[i].iov_base, part, key, offset);
+            done += part;
+            len -= part;
+        }
+
+        if (len && (evbuffer_ptr_set(buf, &pos,
+            done, EVBUFFER_PTR_ADD) == -1))
+            break;
+    }
+
+    return offset;
+}
+
+// заголовок и payload одним резервом в хвосте out
+// при h.masked payload маскируется уже в выходном буфере
+inline void write_frame(e4pp::evbufer_ptr out, frame_header h,
+    const void* payload, std::size_t len)
+{
+    assert(out);
+    h.length = len;
+    auto hsize = header_size(len, h.masked);
+
+    evbuffer_iovec vec{};
+    if (evbuffer_reserve_space(out,
+        static_cast<ev_ssize_t>(hsize + len), &vec, 1) != 1)
+        throw std::runtime_error("evbuffer_reserve_space");
+
+    auto ptr = static_cast<unsigned char*>(vec.iov_base);
+    encode_header(ptr, h);
+    if (len)
+    {
+        std::memcpy(ptr + hsize, payload, len);
+        if (h.masked)
+            mask(ptr + hsize, len, h.mask);
+    }
+
+    vec.iov_len = hsize + len;
+    e4pp::detail::check_result("evbuffer_commit_space",
+        evbuffer_commit_space(out, &vec, 1));
+}
+
+template<class A>
+void write_frame(e4pp::basic_buffer<A>& out, const frame_header& h,
+    const void* payload, std::size_t len)
+{
+    write_frame(out.handle(), h, payload, len);
+}
+
+// payload переносится цепочками без копирования
+// при h.masked payload копируется в резерв out и маскируется там:
+// его цепочки могут ссылаться на чужую или общую память
+// (evbuffer_add_reference), менять их на месте нельзя
+template<class A, class B>
+void write_frame(e4pp::basic_buffer<A>& out, frame_header h,
+    e4pp::basic_buffer<B>& payload)
+{
+    auto len = payload.size();
+    h.length = len;
+
+    if (h.masked)
+    {
+        auto hsize = header_size(len, true);
+        evbuffer_iovec vec{};
+        if (evbuffer_reserve_space(out.handle(),
+            static_cast<ev_ssize_t>(hsize + len), &vec, 1) != 1)
+            throw std::runtime_error("evbuffer_reserve_space");
+
+        auto ptr = static_cast<unsigned char*>(vec.iov_base);
+        encode_header(ptr, h);
+        if (len)
+        {
+            if (evbuffer_remove(payload.handle(), ptr + hsize, len) !=
+                static_cast<int>(len))
+                throw std::runtime_error("evbuffer_remove");
+            mask(ptr + hsize, len, h.mask);
+        }
+
+        vec.iov_len = hsize + len;
+        e4pp::detail::check_result("evbuffer_commit_space",
+            evbuffer_commit_space(out.handle(), &vec, 1));
+        return;
+    }
+
+    unsigned char header[max_header_size];
+    auto hsize = encode_header(header, h);
+    out.append(header, hsize);
+    e4pp::detail::check_result("evbuffer_add_buffer",
+        evbuffer_add_buffer(out.handle(), payload.handle()));
+}
+
+} // namespace ws
+} // namespace http
+} // namespace e4ppx
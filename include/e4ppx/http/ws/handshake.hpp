@@ -4,7 +4,7 @@
 
 #include "e4pp/query.hpp"
 #include "e4pp/http/request.hpp"
-#include "e4ppx/ssl/base64.hpp"
+#include "e4pp/base64.hpp"
 #include "e4ppx/ssl/rand.hpp"
 #include "e4ppx/ssl/sha.hpp"
 #include <event2/http.h>
@@ -28,8 +28,56 @@ struct handshake
         openssl::sha1 f;
         f(str);
 
-        openssl::b64enc b64;
-        return b64(f.data, f.size);
+        return e4pp::base64::encode(f.data.data(), f.size);
+    }
+
+    // ключ клиента - base64 от 16 случайных байт
+    static inline bool valid_client_key(std::string_view key) noexcept
+    {
+        unsigned char raw[16];
+        return (e4pp::base64::decoded_size(key) == sizeof(raw)) &&
+            (e4pp::base64::decode(key.data(), key.size(), raw) == sizeof(raw));
+    }
+
+    // поиск токена в списке через запятую без учета регистра,
+    // например Connection: keep-alive, Upgrade
+    static inline bool has_token(std::string_view list,
+        std::string_view token) noexcept
+    {
+        while (!list.empty())
+        {
+            auto pos = list.find(',');
+            auto item = list.substr(0, pos);
+            list = (pos == std::string_view::npos) ?
+                std::string_view{} : list.substr(pos + 1);
+
+            auto space = [](char c) {
+                return (c == ' ') || (c == '\t');
+            };
+            while (!item.empty() && space(item.front()))
+                item.remove_prefix(1);
+            while (!item.empty() && space(item.back()))
+                item.remove_suffix(1);
+
+            if (item.size() == token.size())
+            {
+                std::size_t i = 0;
+                for (; i < item.size(); ++i)
+                {
+                    auto a = item[i];
+                    auto b = token[i];
+                    if ((a >= 'A') && (a <= 'Z'))
+                        a = static_cast<char>(a - 'A' + 'a');
+                    if ((b >= 'A') && (b <= 'Z'))
+                        b = static_cast<char>(b - 'A' + 'a');
+                    if (a != b)
+                        break;
+                }
+                if (i == item.size())
+                    return true;
+            }
+        }
+        return false;
     }
 
     static inline std::string create_client_key() 
@@ -37,8 +85,7 @@ struct handshake
         std::array<char, 16> ch;
         openssl::rand rnd;
         rnd(reinterpret_cast<uint8_t*>(ch.data()), ch.size());
-        openssl::b64enc b64;
-        return b64(ch.data(), ch.size());
+        return e4pp::base64::encode(ch.data(), ch.size());
     }    
 
     std::string create_key() noexcept
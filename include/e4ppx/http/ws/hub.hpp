@@ -0,0 +1,296 @@
+#pragma once
+
+#include "e4ppx/http/ws/frame.hpp"
+#include "e4pp/functional.hpp"
+
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <vector>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <functional>
+#include <shared_mutex>
+#include <unordered_map>
+
+namespace e4ppx {
+namespace http {
+namespace ws {
+
+// подписки на темы поверх сессий разных очередей
+// сообщение кадрируется один раз в общий evbuffer, подписчики
+// получают его через evbuffer_add_buffer_reference без копирования
+// в чужие очереди кадры уходят пачкой, одно пробуждение на очередь
+// такой кадр читают из нескольких потоков, поэтому evbuffer кадра
+// с блокировкой и нужен e4pp::use_threads, если все подписчики
+// в очереди вызывающего, блокировка не включается
+//
+// кадры hub серверные (без маски) и без permessage-deflate
+// подписчик обычно вызывает engine::send_shared(frame)
+class hub final
+{
+public:
+    using subscription = std::uint64_t;
+    // вызывается в очереди подписчика
+    using deliver_fun = std::function<void(e4pp::evbufer_ptr frame)>;
+
+private:
+    struct entry final
+    {
+        subscription id{};
+        std::string topic{};
+        e4pp::queue_handle_type queue{};
+        deliver_fun fn{};
+        std::atomic<bool> active{true};
+    };
+
+    using entry_ptr = std::shared_ptr<entry>;
+    using frame_ptr = std::shared_ptr<e4pp::buffer>;
+
+    // очередь кадров для одной event_base
+    struct mailbox final
+    {
+        e4pp::queue_handle_type queue{};
+        std::size_t subscribers{};
+        std::mutex mutex{};
+        std::vector<std::pair<entry_ptr, frame_ptr>> pending{};
+        std::vector<std::pair<entry_ptr, frame_ptr>> spare{};
+        bool scheduled{};
+
+        // вызывается в потоке queue
+        void drain() noexcept
+        {
+            {
+                std::lock_guard<std::mutex> l{mutex};
+                spare.swap(pending);
+                scheduled = false;
+            }
+
+            for (auto& [e, frame] : spare)
+            {
+                if (e->active.load(std::memory_order_acquire))
+                {
+                    try {
+                        e->fn(frame->handle());
+                    }
+                    catch (...)
+                    {   }
+                }
+            }
+            spare.clear();
+        }
+    };
+
+    using mailbox_ptr = std::shared_ptr<mailbox>;
+
+    mutable std::shared_mutex mutex_{};
+    std::map<std::string, std::vector<entry_ptr>, std::less<>> topics_{};
+    std::unordered_map<subscription, entry_ptr> entries_{};
+    std::unordered_map<e4pp::queue_handle_type, mailbox_ptr> mailboxes_{};
+    subscription next_id_{};
+
+    static void post(const mailbox_ptr& box) noexcept
+    {
+        try {
+            auto p = e4pp::proxy_call(e4pp::timer_fun{[box]{
+                box->drain();
+            }});
+            timeval tv{};
+            if (event_base_once(box->queue, -1, EV_TIMEOUT,
+                p.second, p.first, &tv) == -1)
+            {
+                delete p.first;
+                std::lock_guard<std::mutex> l{box->mutex};
+                box->scheduled = false;
+            }
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> l{box->mutex};
+            box->scheduled = false;
+        }
+    }
+
+    // куда отдать кадр темы, собирается до кадрирования
+    struct route final
+    {
+        std::vector<entry_ptr> direct{};
+        std::vector<std::pair<mailbox_ptr, entry_ptr>> remote{};
+        std::size_t count{};
+    };
+
+    route collect(std::string_view topic,
+        e4pp::queue_handle_type local) const
+    {
+        route r;
+        std::shared_lock<std::shared_mutex> l{mutex_};
+        auto i = topics_.find(topic);
+        if (i == topics_.end())
+            return r;
+
+        r.count = i->second.size();
+        for (auto& e : i->second)
+        {
+            if (local && (e->queue == local))
+                r.direct.push_back(e);
+            else
+                r.remote.emplace_back(mailboxes_.at(e->queue), e);
+        }
+        return r;
+    }
+
+    static frame_ptr make_frame(const route& r)
+    {
+        auto frame = std::make_shared<e4pp::buffer>();
+        // источник ссылок читают из других потоков
+        if (!r.remote.empty())
+            frame->enable_locking();
+        return frame;
+    }
+
+    static std::size_t dispatch(const route& r, const frame_ptr& frame)
+    {
+        std::vector<mailbox_ptr> wake;
+        for (auto& [box, e] : r.remote)
+        {
+            std::lock_guard<std::mutex> bl{box->mutex};
+            box->pending.emplace_back(e, frame);
+            if (!box->scheduled)
+            {
+                box->scheduled = true;
+                wake.push_back(box);
+            }
+        }
+
+        for (auto& box : wake)
+            post(box);
+
+        // подписчики текущей очереди получают кадр сразу
+        for (auto& e : r.direct)
+        {
+            if (e->active.load(std::memory_order_acquire))
+                e->fn(frame->handle());
+        }
+
+        return r.count;
+    }
+
+public:
+    hub() = default;
+    hub(const hub&) = delete;
+    hub& operator=(const hub&) = delete;
+
+    // queue - очередь сессии, в ней будет вызываться fn
+    subscription subscribe(std::string_view topic,
+        e4pp::queue_handle_type queue, deliver_fun fn)
+    {
+        assert(queue && fn);
+        auto e = std::make_shared<entry>();
+        e->topic = topic;
+        e->queue = queue;
+        e->fn = std::move(fn);
+
+        std::unique_lock<std::shared_mutex> l{mutex_};
+        e->id = ++next_id_;
+
+        auto& box = mailboxes_[queue];
+        if (!box)
+        {
+            box = std::make_shared<mailbox>();
+            box->queue = queue;
+        }
+
+        auto i = topics_.find(topic);
+        if (i == topics_.end())
+            i = topics_.emplace(std::string{topic},
+                std::vector<entry_ptr>{}).first;
+        i->second.push_back(e);
+        ++box->subscribers;
+
+        entries_.emplace(e->id, e);
+        return e->id;
+    }
+
+    // после возврата fn в очереди подписчика больше не вызывается
+    // если unsubscribe вызван в этой же очереди
+    void unsubscribe(subscription id) noexcept
+    {
+        std::unique_lock<std::shared_mutex> l{mutex_};
+        auto i = entries_.find(id);
+        if (i == entries_.end())
+            return;
+
+        auto e = std::move(i->second);
+        entries_.erase(i);
+        e->active.store(false, std::memory_order_release);
+
+        auto t = topics_.find(e->topic);
+        if (t != topics_.end())
+        {
+            auto& v = t->second;
+            v.erase(std::remove(v.begin(), v.end(), e), v.end());
+            if (v.empty())
+                topics_.erase(t);
+        }
+
+        // ожидающие события держат свою копию mailbox
+        auto b = mailboxes_.find(e->queue);
+        if ((b != mailboxes_.end()) && !--b->second->subscribers)
+            mailboxes_.erase(b);
+    }
+
+    // @return число подписчиков темы
+    // local - очередь вызывающего потока, ее подписчики получают
+    // кадр синхронно, остальные через свою очередь
+    std::size_t publish(std::string_view topic, opcode op,
+        const void* data, std::size_t len,
+        e4pp::queue_handle_type local = nullptr)
+    {
+        auto r = collect(topic, local);
+        if (!r.count)
+            return 0;
+
+        auto frame = make_frame(r);
+        frame_header h;
+        h.op = op;
+        write_frame(*frame, h, data, len);
+        return dispatch(r, frame);
+    }
+
+    std::size_t publish(std::string_view topic, opcode op,
+        std::string_view data, e4pp::queue_handle_type local = nullptr)
+    {
+        return publish(topic, op, data.data(), data.size(), local);
+    }
+
+    // payload переносится в кадр цепочками
+    // без подписчиков payload остается нетронутым
+    template<class A>
+    std::size_t publish(std::string_view topic, opcode op,
+        e4pp::basic_buffer<A>& payload,
+        e4pp::queue_handle_type local = nullptr)
+    {
+        auto r = collect(topic, local);
+        if (!r.count)
+            return 0;
+
+        auto frame = make_frame(r);
+        frame_header h;
+        h.op = op;
+        write_frame(*frame, h, payload);
+        return dispatch(r, frame);
+    }
+
+    std::size_t subscribers(std::string_view topic) const
+    {
+        std::shared_lock<std::shared_mutex> l{mutex_};
+        auto i = topics_.find(topic);
+        return (i == topics_.end()) ? 0 : i->second.size();
+    }
+};
+
+} // namespace ws
+} // namespace http
+} // namespace e4ppx
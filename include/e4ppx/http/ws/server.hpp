@@ -0,0 +1,336 @@
+#pragma once
+
+#include "e4pp/http.hpp"
+#include "e4pp/buffer_event.hpp"
+#include "e4ppx/http/ws/handshake.hpp"
+#include "e4ppx/http/ws/deflate.hpp"
+
+#include <memory>
+#include <vector>
+#include <functional>
+
+namespace e4ppx {
+namespace http {
+namespace ws {
+
+// соединение забранное у evhttp после 101 Switching Protocols
+// в libevent 2.1 нет публичного способа отвязать bufferevent
+// от evhttp_connection, поэтому соединение evhttp живет вместе
+// с transport и освобождается в своей очереди при закрытии
+// http::server должен пережить все свои transport
+class transport final
+{
+    // очередь evhttp, в ней освобождается conn_
+    e4pp::queue_handle_type home_{};
+    evhttp_connection* conn_{};
+    // bufferevent в другой очереди после move_to, сокет не закрывает
+    e4pp::buffer_event moved_{};
+    bufferevent* bev_{};
+    // согласованный permessage-deflate
+    permessage_deflate deflate_{};
+
+    static void free_connection(evutil_socket_t, short, void* arg) noexcept
+    {
+        evhttp_connection_free(static_cast<evhttp_connection*>(arg));
+    }
+
+    // bufferevent замораживает хвост input и голову output,
+    // at_start - какой конец заморожен у обоих буферов
+    static void transfer(evbuffer* from, evbuffer* to, bool at_start)
+    {
+        auto frozen = at_start ? from : to;
+        evbuffer_unfreeze(frozen, at_start);
+        auto rc = evbuffer_add_buffer(to, from);
+        evbuffer_freeze(frozen, at_start);
+        e4pp::detail::check_result("evbuffer_add_buffer", rc);
+    }
+
+public:
+    using move_fun = std::function<void(transport)>;
+
+    transport() = default;
+
+    transport(e4pp::queue_handle_type home, evhttp_connection* conn,
+        const permessage_deflate& deflate = {}) noexcept
+        : home_{home}
+        , conn_{conn}
+        , bev_{evhttp_connection_get_bufferevent(conn)}
+        , deflate_{deflate}
+    {
+        assert(home && conn && bev_);
+    }
+
+    transport(transport&& other) noexcept
+        : home_{std::exchange(other.home_, nullptr)}
+        , conn_{std::exchange(other.conn_, nullptr)}
+        , moved_{std::move(other.moved_)}
+        , bev_{std::exchange(other.bev_, nullptr)}
+        , deflate_{other.deflate_}
+    {   }
+
+    transport& operator=(transport&& other) noexcept
+    {
+        if (this != &other)
+        {
+            close();
+            home_ = std::exchange(other.home_, nullptr);
+            conn_ = std::exchange(other.conn_, nullptr);
+            moved_ = std::move(other.moved_);
+            bev_ = std::exchange(other.bev_, nullptr);
+            deflate_ = other.deflate_;
+        }
+        return *this;
+    }
+
+    transport(const transport&) = delete;
+    transport& operator=(const transport&) = delete;
+
+    ~transport() noexcept
+    {
+        close();
+    }
+
+    bufferevent* handle() const noexcept
+    {
+        return bev_;
+    }
+
+    operator bufferevent*() const noexcept
+    {
+        return handle();
+    }
+
+    bool empty() const noexcept
+    {
+        return nullptr == handle();
+    }
+
+    e4pp::buffer_event_ref ref() const noexcept
+    {
+        return e4pp::buffer_event_ref{handle()};
+    }
+
+    // передается в engine::set_deflate
+    const permessage_deflate& deflate() const noexcept
+    {
+        return deflate_;
+    }
+
+    e4pp::queue_handle_type queue() const noexcept
+    {
+        return bufferevent_get_base(e4pp::assert_handle(handle()));
+    }
+
+    // закрывает сокет, вызывается в потоке текущей очереди
+    // если transport был перенесен, очередь evhttp должна работать
+    // с включенными потоками (e4pp::use_threads)
+    void close() noexcept
+    {
+        if (!conn_)
+            return;
+
+        // сокет закрывает evhttp_connection_free
+        auto moved = static_cast<bool>(moved_);
+        moved_.close();
+        bev_ = nullptr;
+
+        auto conn = std::exchange(conn_, nullptr);
+        if (moved)
+        {
+            timeval tv{};
+            if (event_base_once(home_, -1, EV_TIMEOUT,
+                free_connection, conn, &tv) == 0)
+                return;
+        }
+        evhttp_connection_free(conn);
+    }
+
+    // переносит соединение в другую очередь, например в пул потоков
+    // fn вызывается уже в потоке target, до этого соединение не
+    // обрабатывается, все что осталось в буферах переносится
+    void move_to(e4pp::queue& target, move_fun fn)
+    {
+        assert(bev_ && fn);
+        bufferevent_setcb(bev_, nullptr, nullptr, nullptr, nullptr);
+        bufferevent_disable(bev_, EV_READ|EV_WRITE);
+
+        struct state final
+        {
+            transport self;
+            move_fun fn;
+            e4pp::queue_handle_type target;
+        };
+
+        auto s = new state{std::move(*this), std::move(fn), target.handle()};
+        try {
+            target.once([s]{
+                std::unique_ptr<state> p{s};
+                auto& t = p->self;
+                auto old = t.bev_;
+
+                // без BEV_OPT_CLOSE_ON_FREE, сокетом владеет evhttp
+                e4pp::buffer_event bev{e4pp::bev{
+                    e4pp::detail::check_pointer("bufferevent_socket_new",
+                        bufferevent_socket_new(p->target,
+                            bufferevent_getfd(old), 0))}};
+                transfer(bufferevent_get_input(old), bev.input_handle(), false);
+                transfer(bufferevent_get_output(old), bev.output_handle(), true);
+
+                t.bev_ = bev.handle();
+                t.moved_ = std::move(bev);
+                p->fn(std::move(t));
+            });
+        }
+        catch (...)
+        {
+            *this = std::move(s->self);
+            delete s;
+            throw;
+        }
+    }
+};
+
+using upgrade_fun = std::function<void(transport, e4pp::http::request_ref)>;
+
+struct upgrade_options
+{
+    // Sec-WebSocket-Protocol, пустой - без подпротокола
+    std::string protocol{};
+    // permessage-deflate, включается через deflate.enabled
+    permessage_deflate deflate{};
+};
+
+// http::server с обработчиками websocket upgrade
+class server
+    : public e4pp::http::server
+{
+    struct route final
+    {
+        upgrade_fun fn;
+        upgrade_options options;
+    };
+
+    std::vector<std::unique_ptr<route>> routes_{};
+
+    static const char* find(evkeyvalq* headers, const char* key) noexcept
+    {
+        auto val = evhttp_find_header(headers, key);
+        return val ? val : "";
+    }
+
+    static void reject(evhttp_request* req, int code,
+        const char* reason) noexcept
+    {
+        evhttp_send_error(req, code, reason);
+    }
+
+    static void upgrade(evhttp_request* req, void* arg) noexcept
+    {
+        assert(arg);
+        auto& r = *static_cast<route*>(arg);
+
+        auto headers = evhttp_request_get_input_headers(req);
+        if ((evhttp_request_get_command(req) != EVHTTP_REQ_GET) ||
+            !handshake::has_token(find(headers, "Upgrade"), "websocket") ||
+            !handshake::has_token(find(headers, "Connection"), "upgrade"))
+        {
+            reject(req, HTTP_BADREQUEST, "Bad Request");
+            return;
+        }
+
+        if (std::string_view{find(headers, "Sec-WebSocket-Version")} != "13")
+        {
+            evhttp_add_header(evhttp_request_get_output_headers(req),
+                "Sec-WebSocket-Version", "13");
+            evhttp_send_reply(req, 426, "Upgrade Required", nullptr);
+            return;
+        }
+
+        std::string key{find(headers, "Sec-WebSocket-Key")};
+        if (!handshake::valid_client_key(key))
+        {
+            reject(req, HTTP_BADREQUEST, "Bad Request");
+            return;
+        }
+
+        auto& protocol = r.options.protocol;
+        if (!protocol.empty() && !handshake::has_token(
+            find(headers, "Sec-WebSocket-Protocol"), protocol))
+        {
+            reject(req, HTTP_BADREQUEST, "Bad Request");
+            return;
+        }
+
+        try {
+            auto conn = evhttp_request_get_connection(req);
+            auto bev = evhttp_connection_get_bufferevent(conn);
+            auto output = bufferevent_get_output(bev);
+
+            // ответ пишется напрямую, evhttp больше не участвует
+            std::string reply;
+            reply.reserve(256);
+            reply += "HTTP/1.1 101 Switching Protocols\r\n"
+                "Upgrade: websocket\r\n"
+                "Connection: Upgrade\r\n"
+                "Sec-WebSocket-Accept: ";
+            reply += handshake::create_accept_key(key);
+            if (!protocol.empty())
+            {
+                reply += "\r\nSec-WebSocket-Protocol: ";
+                reply += protocol;
+            }
+            permessage_deflate agreed;
+            std::string extensions;
+            if (r.options.deflate.enabled &&
+                r.options.deflate.negotiate(
+                    find(headers, "Sec-WebSocket-Extensions"),
+                    agreed, extensions))
+            {
+                reply += "\r\nSec-WebSocket-Extensions: ";
+                reply += extensions;
+            }
+            else
+            {
+                // без расширения в 101 сжатие не включается
+                agreed = permessage_deflate{};
+            }
+            reply += "\r\n\r\n";
+            e4pp::detail::check_result("evbuffer_add",
+                evbuffer_add(output, reply.data(), reply.size()));
+
+            evhttp_connection_set_closecb(conn, nullptr, nullptr);
+            bufferevent_set_timeouts(bev, nullptr, nullptr);
+            bufferevent_setcb(bev, nullptr, nullptr, nullptr, nullptr);
+            bufferevent_enable(bev, EV_WRITE);
+
+            r.fn(transport{bufferevent_get_base(bev), conn, agreed},
+                e4pp::http::request_ref{req});
+        }
+        catch (...)
+        {   }
+    }
+
+public:
+    using e4pp::http::server::server;
+
+    server(server&&) = default;
+    server& operator=(server&&) = default;
+
+    // handler получает transport и исходный запрос, обычно
+    // создает сессию с engine<T>{..., role::server} и вызывает
+    // engine.set_deflate(transport.deflate()), engine.setup(transport.handle())
+    void upgrade_websocket(const char* path, upgrade_fun fn,
+        upgrade_options options = {})
+    {
+        assert(path && fn);
+        auto r = std::make_unique<route>(route{std::move(fn),
+            std::move(options)});
+        e4pp::detail::check_result("evhttp_set_cb",
+            evhttp_set_cb(assert_handle(), path, upgrade, r.get()));
+        routes_.push_back(std::move(r));
+    }
+};
+
+} // namespace ws
+} // namespace http
+} // namespace e4ppx
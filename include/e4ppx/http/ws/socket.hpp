@@ -1,8 +1,13 @@
 #pragma once
 
 #include "e4pp/queue.hpp"
+#include "e4pp/http/connection.hpp"
 #include "e4ppx/http/ws/handshake.hpp"
+#include "e4ppx/http/ws/engine.hpp"
+// wslay остается как альтернативный адаптер
+#ifdef E4PPX_WS_WSLAY
 #include "e4ppx/http/ws/evwslay.hpp"
+#endif // E4PPX_WS_WSLAY
 
 namespace e4ppx {
 namespace http {
@@ -13,12 +18,12 @@ class socket
 {
     using self_type = T;
     using protocol_fn = bool (T::*)(std::string_view);
-    using data_fn = void (T::*)(wslay_opcode, const char*, std::size_t);
+    using data_fn = void (T::*)(opcode, const char*, std::size_t);
     using error_fn = void (T::*)(short what);
 
     T& self_;
     e4pp::queue& queue_;
-    //evwslay adapter_{*this};
+    //engine<socket> adapter_{*this};
     handshake handshaker_{};
     e4pp::http::connection conn_{};
 
@@ -0,0 +1,322 @@
+#pragma once
+
+#include "e4ppx/ssl/bev.hpp"
+#include "e4pp/queue.hpp"
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <vector>
+#include <functional>
+
+namespace e4ppx {
+namespace openssl {
+
+// потоки для шагов handshake, каждый крутит свою очередь
+// нужен e4pp::use_threads, пул должен пережить все handshake
+class handshake_pool final
+{
+    struct worker final
+    {
+        e4pp::queue queue{};
+        std::thread thread{};
+    };
+
+    std::vector<std::unique_ptr<worker>> workers_{};
+    std::atomic<std::size_t> next_{};
+
+public:
+    explicit handshake_pool(std::size_t threads =
+        std::thread::hardware_concurrency())
+    {
+        if (!threads)
+            threads = 1;
+
+        workers_.reserve(threads);
+        for (std::size_t i = 0; i < threads; ++i)
+        {
+            auto w = std::make_unique<worker>();
+            auto q = &w->queue;
+            w->thread = std::thread{[q]{
+                q->loop(e4pp::evloop_no_exit_on_empty);
+            }};
+            workers_.push_back(std::move(w));
+        }
+    }
+
+    handshake_pool(const handshake_pool&) = delete;
+    handshake_pool& operator=(const handshake_pool&) = delete;
+
+    ~handshake_pool()
+    {
+        // loop_break до старта цикла потерялся бы, once дождется цикла
+        for (auto& w : workers_)
+        {
+            auto q = &w->queue;
+            try {
+                q->once([q]{
+                    q->loop_break();
+                });
+            }
+            catch (...)
+            {
+                q->loop_break();
+            }
+        }
+
+        for (auto& w : workers_)
+            w->thread.join();
+    }
+
+    std::size_t size() const noexcept
+    {
+        return workers_.size();
+    }
+
+    // очереди раздаются по кругу
+    e4pp::queue_handle_type next() noexcept
+    {
+        auto i = next_.fetch_add(1, std::memory_order_relaxed);
+        return workers_[i % workers_.size()]->queue.handle();
+    }
+};
+
+// conn пустой при ошибке, error - код OpenSSL, 0 при таймауте
+// или закрытии соединения
+using handshake_fun = std::function<void(bev conn, unsigned long error)>;
+
+namespace detail {
+
+// SSL_do_handshake выполняется в потоке пула: подпись ключом
+// сервера, обмен ключами и проверка цепочки не занимают очередь
+// владельца, а готовность сокета ждется в ней
+// SSL в каждый момент принадлежит одному потоку
+class async_handshake final
+{
+    struct free_ssl
+    {
+        void operator()(SSL* ptr) noexcept
+        {
+            SSL_free(ptr);
+        }
+    };
+
+    e4pp::queue_handle_type owner_{};
+    handshake_pool& pool_;
+    std::unique_ptr<SSL, free_ssl> ssl_{};
+    evutil_socket_t fd_{-1};
+    bufferevent_ssl_state state_{};
+    int opt_{};
+    handshake_fun fn_{};
+    // срок на весь handshake, включая шаги в пуле
+    std::chrono::steady_clock::time_point deadline_{};
+    bool has_timeout_{};
+    // результат шага в пуле
+    int wait_{};
+    unsigned long error_{};
+
+    // вызов в очереди владельца, кроме сбоя возврата из пула
+    // в step, this удаляется
+    void finish(bev conn, unsigned long error) noexcept
+    {
+        std::unique_ptr<async_handshake> self{this};
+        try {
+            fn_(std::move(conn), error);
+        }
+        catch (...)
+        {   }
+    }
+
+    void fail(unsigned long error) noexcept
+    {
+        ssl_.reset();
+        if (opt_ & BEV_OPT_CLOSE_ON_FREE)
+            evutil_closesocket(fd_);
+        finish(bev{}, error);
+    }
+
+    static void step(evutil_socket_t, short, void* arg) noexcept
+    {
+        auto self = static_cast<async_handshake*>(arg);
+        auto ssl = self->ssl_.get();
+
+        ERR_clear_error();
+        auto rc = SSL_do_handshake(ssl);
+        switch (rc == 1 ? SSL_ERROR_NONE : SSL_get_error(ssl, rc))
+        {
+        case SSL_ERROR_NONE:
+            self->wait_ = 0;
+            break;
+        case SSL_ERROR_WANT_READ:
+            self->wait_ = EV_READ;
+            break;
+        case SSL_ERROR_WANT_WRITE:
+            self->wait_ = EV_WRITE;
+            break;
+        default:
+            self->wait_ = -1;
+            self->error_ = ERR_get_error();
+        }
+        // очередь ошибок OpenSSL у каждого потока своя
+        ERR_clear_error();
+
+        timeval tv{};
+        if (event_base_once(self->owner_, -1, EV_TIMEOUT,
+            resume, self, &tv) == -1)
+        {
+            // вернуть результат в очередь владельца нечем,
+            // fn узнает об ошибке в потоке пула
+            self->fail(0);
+        }
+    }
+
+    static void resume(evutil_socket_t, short, void* arg) noexcept
+    {
+        auto self = static_cast<async_handshake*>(arg);
+        if (self->wait_ < 0)
+        {
+            self->fail(self->error_);
+            return;
+        }
+
+        if (self->wait_)
+        {
+            self->wait(static_cast<short>(self->wait_));
+            return;
+        }
+
+        auto ptr = bufferevent_openssl_socket_new(self->owner_, self->fd_,
+            self->ssl_.get(), BUFFEREVENT_SSL_OPEN, self->opt_);
+        if (!ptr)
+        {
+            self->fail(0);
+            return;
+        }
+
+        self->ssl_.release();
+        self->finish(bev{ptr}, 0);
+    }
+
+    static void ready(evutil_socket_t, short what, void* arg) noexcept
+    {
+        auto self = static_cast<async_handshake*>(arg);
+        if (what & EV_TIMEOUT)
+            self->fail(0);
+        else
+            self->post();
+    }
+
+    void wait(short what) noexcept
+    {
+        timeval tv{};
+        if (has_timeout_)
+        {
+            auto left = deadline_ - std::chrono::steady_clock::now();
+            if (left <= left.zero())
+            {
+                fail(0);
+                return;
+            }
+            tv = e4pp::make_timeval(left);
+        }
+
+        if (event_base_once(owner_, fd_, what, ready, this,
+            has_timeout_ ? &tv : nullptr) == -1)
+            fail(0);
+    }
+
+    void post() noexcept
+    {
+        timeval tv{};
+        if (event_base_once(pool_.next(), -1, EV_TIMEOUT,
+            step, this, &tv) == -1)
+            fail(0);
+    }
+
+public:
+    async_handshake(e4pp::queue_handle_type owner, handshake_pool& pool,
+        SSL* ssl, evutil_socket_t fd, bufferevent_ssl_state state,
+        e4pp::bev_flag opt, handshake_fun fn, const timeval* timeout) noexcept
+        : owner_{owner}
+        , pool_{pool}
+        , ssl_{ssl}
+        , fd_{fd}
+        , state_{state}
+        , opt_{opt}
+        , fn_{std::move(fn)}
+    {
+        if (timeout)
+        {
+            deadline_ = std::chrono::steady_clock::now() +
+                std::chrono::seconds{timeout->tv_sec} +
+                std::chrono::microseconds{timeout->tv_usec};
+            has_timeout_ = true;
+        }
+    }
+
+    // сервер сначала ждет ClientHello, клиент сразу готовит свой
+    void start() noexcept
+    {
+        if (state_ == BUFFEREVENT_SSL_ACCEPTING)
+        {
+            SSL_set_accept_state(ssl_.get());
+            wait(EV_READ);
+        }
+        else
+        {
+            SSL_set_connect_state(ssl_.get());
+            post();
+        }
+    }
+};
+
+inline void start_handshake(e4pp::queue_handle_type queue,
+    handshake_pool& pool, SSL* ssl, evutil_socket_t fd,
+    bufferevent_ssl_state state, e4pp::bev_flag opt, handshake_fun fn,
+    const timeval* timeout)
+{
+    assert(queue && ssl && fn);
+    assert(fd != -1);
+
+    if (!SSL_set_fd(ssl, static_cast<int>(fd)))
+    {
+        SSL_free(ssl);
+        throw std::runtime_error("SSL_set_fd failed");
+    }
+
+    evutil_make_socket_nonblocking(fd);
+    // при ошибке async_handshake сам вызовет fn и удалится
+    (new async_handshake{queue, pool, ssl, fd, state,
+        opt, std::move(fn), timeout})->start();
+}
+
+} // namespace detail
+
+// handshake на подключенном сокете с вычислениями в пуле
+// fn вызывается в очереди queue с готовым bev
+// (BUFFEREVENT_SSL_OPEN) или пустым при ошибке, SSL* передается
+// во владение, при ошибке fd закрывается если задан bev_close_on_free
+// timeout - на весь handshake, а не на каждое ожидание сокета
+inline void accept_async(e4pp::queue_handle_type queue,
+    handshake_pool& pool, SSL* ssl, evutil_socket_t fd, handshake_fun fn,
+    const timeval* timeout = nullptr,
+    e4pp::bev_flag opt = e4pp::bev_close_on_free)
+{
+    detail::start_handshake(queue, pool, ssl, fd,
+        BUFFEREVENT_SSL_ACCEPTING, opt, std::move(fn), timeout);
+}
+
+inline void connect_async(e4pp::queue_handle_type queue,
+    handshake_pool& pool, SSL* ssl, evutil_socket_t fd, handshake_fun fn,
+    const timeval* timeout = nullptr,
+    e4pp::bev_flag opt = e4pp::bev_close_on_free)
+{
+    detail::start_handshake(queue, pool, ssl, fd,
+        BUFFEREVENT_SSL_CONNECTING, opt, std::move(fn), timeout);
+}
+
+} // namespace openssl
+} // namespace e4ppx
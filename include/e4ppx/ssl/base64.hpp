@@ -1,52 +1,30 @@
 #pragma once
 
-#include <openssl/bio.h>
-#include <openssl/evp.h>
-#include <openssl/buffer.h>
+#include "e4pp/base64.hpp"
+
 #include <stdint.h>
 #include <string_view>
 #include <stdexcept>
 
+// совместимость, новый код использует e4pp::base64 напрямую
+
 namespace e4ppx {
 namespace openssl {
 
 struct b64enc
 {
-    int encode(const void* in, int in_len, char *out, int out_len)
+    int encode(const void* in, int in_len, char *out, int out_len) noexcept
     {
-        int ret = 0;
-
-        BIO *b64 = BIO_new(BIO_f_base64());
-        BIO *bio = BIO_new(BIO_s_mem());
-        if (b64 && bio)
-        {
-            BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
-            BIO_push(b64, bio);
-
-            ret = BIO_write(b64, in, in_len);
-            BIO_flush(b64);
+        auto len = static_cast<std::size_t>(in_len);
+        if (e4pp::base64::encoded_size(len) > static_cast<std::size_t>(out_len))
+            return 0;
 
-            if (ret > 0)
-                ret = BIO_read(bio, out, out_len);
-
-            BIO_free(b64);
-        }
-
-        return ret;
+        return static_cast<int>(e4pp::base64::encode(in, len, out));
     }
 
     std::string operator()(const void* in, int in_len)
     {
-        std::string rc;
-        rc.resize(2 * in_len);
-
-        auto ret = encode(in, in_len, rc.data(), rc.size());
-        if (ret > 0)
-            rc.resize(static_cast<std::size_t>(ret));
-        else
-            rc.clear();
-
-        return rc;
+        return e4pp::base64::encode(in, static_cast<std::size_t>(in_len));
     }
 };
 
@@ -54,30 +32,19 @@ struct b64dec
 {
     int decode(const char* in, int in_len, char *out, int out_len) noexcept
     {
-        int ret = 0;
-
-        BIO *b64 = BIO_new(BIO_f_base64());
-        BIO *bio = BIO_new(BIO_s_mem());
-        if (b64 && bio)
-        {
-            BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
-            BIO_push(b64, bio);
-
-            ret = BIO_write(bio, in, in_len);
-            BIO_flush(bio);
-
-            if (ret)
-                ret = BIO_read(b64, out, out_len);
-
-            BIO_free(b64);
-        }
-
-        return ret;
+        auto len = static_cast<std::size_t>(in_len);
+        auto size = e4pp::base64::decoded_size(in, len);
+        if ((size == e4pp::base64::npos) ||
+            (size > static_cast<std::size_t>(out_len)))
+            return 0;
+
+        size = e4pp::base64::decode(in, len, out);
+        return (size == e4pp::base64::npos) ? 0 : static_cast<int>(size);
     }
 
     int operator()(std::string_view msg, char *out, int out_len) noexcept
     {
-        return decode(msg.data(), msg.size(), out, out_len);
+        return decode(msg.data(), static_cast<int>(msg.size()), out, out_len);
     }
 };
 
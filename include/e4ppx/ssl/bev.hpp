@@ -1,14 +1,116 @@
 #pragma once
 
 #include "e4pp/bev.hpp"
+#include "e4pp/reclaim.hpp"
 #include <event2/bufferevent_ssl.h>
 #include <openssl/ssl.h>
 #include <openssl/x509.h>
+#include <openssl/err.h>
 #include <memory>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
 
 namespace e4ppx {
 namespace openssl {
 
+// Dynamic TLS record size policy: small records let the peer decrypt
+// the first bytes early, large records cut per-record overhead
+struct record_sizing
+{
+    // record payload at connection start and after idle (about one MSS)
+    std::size_t initial{1400};
+    // record payload during sustained writes
+    std::size_t max{16384};
+    // bytes written with small records before switching to max
+    std::size_t boost_after{1024 * 1024};
+    // no writes for this long resets to initial
+    std::chrono::milliseconds idle{1000};
+};
+
+namespace detail {
+
+// record size state, lives in SSL ex_data and follows output drains
+struct record_sizer final
+{
+    SSL* ssl{};
+    record_sizing policy{};
+    std::size_t current{};
+    std::size_t target{};
+    std::size_t sent{};
+    std::chrono::steady_clock::time_point last{};
+
+    static std::size_t clamp(std::size_t size) noexcept
+    {
+        // SSL_set_max_send_fragment accepts 512..16384
+        return (std::min)((std::max)(size, std::size_t{512}),
+            std::size_t{SSL3_RT_MAX_PLAIN_LENGTH});
+    }
+
+    // SSL_write interrupted by WANT_WRITE must be retried with the
+    // same record layout, so the change waits for the next drain
+    void apply(std::size_t size) noexcept
+    {
+        target = clamp(size);
+        if ((target == current) || SSL_want_write(ssl))
+            return;
+
+        // write buffer is sized by max_send_fragment when allocated,
+        // a larger record needs it reallocated
+        if ((target > current) && !SSL_free_buffers(ssl))
+            return;
+
+        current = target;
+        // lowering max also lowers split, raising max does not
+        SSL_set_max_send_fragment(ssl, static_cast<long>(current));
+        SSL_set_split_send_fragment(ssl, static_cast<long>(current));
+    }
+
+    void reset() noexcept
+    {
+        sent = 0;
+        apply(policy.initial);
+    }
+
+    static void free_sizer(void*, void* ptr, CRYPTO_EX_DATA*,
+        int, long, void*) noexcept
+    {
+        delete static_cast<record_sizer*>(ptr);
+    }
+
+    static int index()
+    {
+        static const int idx = SSL_get_ex_new_index(0,
+            nullptr, nullptr, nullptr, free_sizer);
+        if (idx < 0)
+            throw std::runtime_error("SSL_get_ex_new_index failed");
+        return idx;
+    }
+
+    // output callback: added data after idle starts small again,
+    // drained data counts toward boost_after
+    static void output_cb(evbuffer*, const evbuffer_cb_info* info,
+        void* arg) noexcept
+    {
+        auto self = static_cast<record_sizer*>(arg);
+        auto now = std::chrono::steady_clock::now();
+        if (info->n_added && (now - self->last >= self->policy.idle))
+            self->reset();
+        else
+            self->apply(self->target);
+        self->last = now;
+
+        if (info->n_deleted && (self->target < clamp(self->policy.max)))
+        {
+            self->sent += info->n_deleted;
+            if (self->sent >= self->policy.boost_after)
+                self->apply(self->policy.max);
+        }
+    }
+};
+
+} // namespace detail
+
 // SSL buffer event class
 class bev : public e4pp::bev
 {
@@ -170,6 +272,206 @@ public:
         bufferevent_openssl_set_allow_dirty_shutdown(assert_handle(), 1);
     }
 
+    // Kernel TLS (Linux kTLS, OpenSSL 3.0+)
+    // Request kTLS for the connection, must be called before handshake.
+    // After handshake OpenSSL hands record encryption to the kernel
+    // socket, or silently stays in userspace if the tls module or
+    // negotiated cipher is not supported
+    static bool enable_ktls(SSL* ssl) noexcept
+    {
+        assert(ssl);
+#ifdef SSL_OP_ENABLE_KTLS
+        SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+        return true;
+#else
+        return false;
+#endif // SSL_OP_ENABLE_KTLS
+    }
+
+    bool enable_ktls() noexcept
+    {
+        return enable_ktls(assert_ssl());
+    }
+
+    // kernel encrypts outgoing records
+    bool ktls_send() const noexcept
+    {
+#ifdef SSL_OP_ENABLE_KTLS
+        auto bio = SSL_get_wbio(assert_ssl());
+        return bio && BIO_get_ktls_send(bio);
+#else
+        return false;
+#endif // SSL_OP_ENABLE_KTLS
+    }
+
+    // kernel decrypts incoming records
+    bool ktls_recv() const noexcept
+    {
+#ifdef SSL_OP_ENABLE_KTLS
+        auto bio = SSL_get_rbio(assert_ssl());
+        return bio && BIO_get_ktls_recv(bio);
+#else
+        return false;
+#endif // SSL_OP_ENABLE_KTLS
+    }
+
+    // Send file range, takes ownership of file like evbuffer_add_file.
+    // With kTLS send and empty output the file goes out by SSL_sendfile
+    // without userspace copy until the socket would block, the rest
+    // is queued through output and encrypted by the usual write path
+    // @return bytes sent by the kernel
+    std::size_t send_file(evutil_socket_t file, ev_off_t offset,
+        ev_off_t length)
+    {
+        assert(file != -1);
+        assert(length >= 0);
+
+        std::size_t sent = 0;
+#ifdef SSL_OP_ENABLE_KTLS
+        auto output = output_handle();
+        if (ktls_send() && !evbuffer_get_length(output))
+        {
+            auto ssl_ptr = assert_ssl();
+            while (length > 0)
+            {
+                auto rc = SSL_sendfile(ssl_ptr, file, offset,
+                    static_cast<std::size_t>(length), 0);
+                if (rc <= 0)
+                {
+                    ERR_clear_error();
+                    break;
+                }
+                offset += rc;
+                length -= rc;
+                sent += static_cast<std::size_t>(rc);
+            }
+
+            if (!length)
+            {
+                evutil_closesocket(file);
+                return sent;
+            }
+        }
+#endif // SSL_OP_ENABLE_KTLS
+
+        e4pp::detail::check_result("evbuffer_add_file",
+            evbuffer_add_file(output_handle(), file, offset, length));
+        return sent;
+    }
+
+    // Enable dynamic record sizing for this connection,
+    // calling again replaces the policy.
+    // libevent passes each output chain to one SSL_write, so the size
+    // changes between chains: one large evbuffer_add keeps its size
+    void set_record_sizing(const record_sizing& policy = {})
+    {
+        auto ssl_ptr = assert_ssl();
+        auto idx = detail::record_sizer::index();
+        auto sizer = static_cast<detail::record_sizer*>(
+            SSL_get_ex_data(ssl_ptr, idx));
+        if (!sizer)
+        {
+            auto p = std::make_unique<detail::record_sizer>();
+            p->ssl = ssl_ptr;
+            if (!SSL_set_ex_data(ssl_ptr, idx, p.get()))
+                throw std::runtime_error("SSL_set_ex_data failed");
+            sizer = p.release();
+
+            // with close on free be_openssl_destruct frees the SSL
+            // (and the sizer) before evbuffer_free(output); the stale
+            // arg is never used since evbuffer_free runs no callbacks
+            e4pp::detail::check_pointer("evbuffer_add_cb",
+                evbuffer_add_cb(output_handle(),
+                    detail::record_sizer::output_cb, sizer));
+        }
+
+        sizer->policy = policy;
+        sizer->last = std::chrono::steady_clock::now();
+        sizer->reset();
+    }
+
+    // Current record payload limit, 0 without record sizing
+    std::size_t record_size() const noexcept
+    {
+        try {
+            auto sizer = static_cast<detail::record_sizer*>(
+                SSL_get_ex_data(assert_ssl(), detail::record_sizer::index()));
+            return sizer ? sizer->current : 0;
+        }
+        catch (...)
+        {   }
+        return 0;
+    }
+
+    // Release OpenSSL record buffers of an idle connection.
+    // Each SSL keeps a read and a write buffer (about 17 KB each)
+    // for its whole life; with SSL_MODE_RELEASE_BUFFERS they are freed
+    // after every record until keep_buffers is called
+    // @return estimated bytes freed now, both buffers are assumed held
+    static std::size_t release_buffers(SSL* ssl) noexcept
+    {
+        assert(ssl);
+        if (SSL_get_mode(ssl) & SSL_MODE_RELEASE_BUFFERS)
+            return 0;
+
+        SSL_set_mode(ssl, SSL_MODE_RELEASE_BUFFERS);
+        // a pending record keeps its buffer, the mode frees it later
+        if (!SSL_free_buffers(ssl))
+            return 0;
+
+        // with record sizing the write buffer follows the record size
+        std::size_t fragment = SSL3_RT_MAX_PLAIN_LENGTH;
+        try {
+            auto sizer = static_cast<detail::record_sizer*>(
+                SSL_get_ex_data(ssl, detail::record_sizer::index()));
+            if (sizer && sizer->current)
+                fragment = sizer->current;
+        }
+        catch (...)
+        {   }
+
+        constexpr std::size_t align = SSL3_ALIGN_PAYLOAD - 1;
+        return SSL3_RT_MAX_PLAIN_LENGTH + SSL3_RT_MAX_ENCRYPTED_OVERHEAD +
+            SSL3_RT_HEADER_LENGTH + align +
+            fragment + SSL3_RT_SEND_MAX_ENCRYPTED_OVERHEAD +
+            SSL3_RT_HEADER_LENGTH + align;
+    }
+
+    // Keep record buffers between records again (active connection)
+    static void keep_buffers(SSL* ssl) noexcept
+    {
+        assert(ssl);
+        SSL_clear_mode(ssl, SSL_MODE_RELEASE_BUFFERS);
+    }
+
+    std::size_t release_buffers() noexcept
+    {
+        return release_buffers(assert_ssl());
+    }
+
+    void keep_buffers() noexcept
+    {
+        keep_buffers(assert_ssl());
+    }
+
+    // Release hook for e4pp::idle_reclaim: frees record buffers on idle
+    // and keeps them again on activity, the SSL must outlive the hook
+    static e4pp::idle_reclaim::release_fun reclaim_hook(SSL* ssl)
+    {
+        assert(ssl);
+        return [ssl](bool idle) -> std::size_t {
+            if (idle)
+                return release_buffers(ssl);
+            keep_buffers(ssl);
+            return 0;
+        };
+    }
+
+    e4pp::idle_reclaim::release_fun reclaim_hook() const
+    {
+        return reclaim_hook(assert_ssl());
+    }
+
     // Get peer certificate
     X509* get_peer_certificate() const noexcept
     {
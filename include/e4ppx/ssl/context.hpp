@@ -1,8 +1,10 @@
 #pragma once
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include "e4ppx/ssl/trust.hpp"
 #include <memory>
 #include <stdexcept>
+#include <string>
 
 namespace e4ppx {
 namespace openssl {
@@ -58,14 +60,33 @@ public:
         // Set verification mode
         SSL_CTX_set_verify(ctx.ctx_.get(), SSL_VERIFY_PEER, nullptr);
         
-        // Load default CA certificates
-        if (SSL_CTX_set_default_verify_paths(ctx.ctx_.get()) != 1) {
-            throw std::runtime_error("SSL_CTX_set_default_verify_paths failed");
-        }
+        // Share process-wide default CA store, loaded once
+        trust_store::attach(ctx.ctx_.get());
         
         return ctx;
     }
 
+    // Create server context
+    static context create_server()
+    {
+        context ctx;
+        ctx.ctx_.reset(SSL_CTX_new(TLS_server_method()));
+        if (!ctx.ctx_) {
+            throw std::runtime_error("SSL_CTX_new failed");
+        }
+        return ctx;
+    }
+
+    // Create server context with certificate chain and private key (PEM)
+    static context create_server(const std::string& cert_file,
+        const std::string& key_file)
+    {
+        auto ctx = create_server();
+        ctx.use_certificate_chain_file(cert_file);
+        ctx.use_private_key_file(key_file);
+        return ctx;
+    }
+
     handle_type handle() const noexcept
     {
         return ctx_.get();
@@ -80,6 +101,43 @@ public:
     {
         SSL_CTX_set_verify(handle(), SSL_VERIFY_PEER, callback);
     }
+
+    void use_certificate_chain_file(const std::string& file)
+    {
+        if (SSL_CTX_use_certificate_chain_file(handle(), file.c_str()) != 1) {
+            throw std::runtime_error("SSL_CTX_use_certificate_chain_file failed");
+        }
+    }
+
+    // Load private key and check it matches the certificate
+    void use_private_key_file(const std::string& file)
+    {
+        if (SSL_CTX_use_PrivateKey_file(handle(), file.c_str(),
+            SSL_FILETYPE_PEM) != 1) {
+            throw std::runtime_error("SSL_CTX_use_PrivateKey_file failed");
+        }
+
+        if (SSL_CTX_check_private_key(handle()) != 1) {
+            throw std::runtime_error("SSL_CTX_check_private_key failed");
+        }
+    }
+
+    // Request kernel TLS for all connections, see bev::enable_ktls
+    bool enable_ktls() noexcept
+    {
+#ifdef SSL_OP_ENABLE_KTLS
+        SSL_CTX_set_options(handle(), SSL_OP_ENABLE_KTLS);
+        return true;
+#else
+        return false;
+#endif // SSL_OP_ENABLE_KTLS
+    }
+
+    // Release ownership
+    auto release() noexcept
+    {
+        return ctx_.release();
+    }
 };
     
 } // namespace openssl
@@ -0,0 +1,206 @@
+#pragma once
+
+#include "e4pp/buffer.hpp"
+
+#include <openssl/evp.h>
+#include <openssl/md5.h>
+#include <openssl/sha.h>
+#include <array>
+#include <span>
+#include <memory>
+#include <string_view>
+#include <stdexcept>
+
+namespace e4ppx {
+namespace openssl {
+namespace detail {
+
+struct free_md
+{
+    void operator()(EVP_MD* ptr) noexcept
+    {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        EVP_MD_free(ptr);
+#else
+        (void)ptr;
+#endif
+    }
+};
+
+// в openssl 3 EVP_sha1() и подобные делают implicit fetch
+// на каждом init, алгоритм выбирается один раз на процесс
+template<const EVP_MD* (*Legacy)()>
+const EVP_MD* fetch_md(const char* name)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    static const std::unique_ptr<EVP_MD, free_md> md{
+        EVP_MD_fetch(nullptr, name, nullptr)};
+    if (md)
+        return md.get();
+#else
+    (void)name;
+#endif
+    return Legacy();
+}
+
+inline const EVP_MD* md_sha1()
+{
+    return fetch_md<EVP_sha1>("SHA1");
+}
+
+inline const EVP_MD* md_sha256()
+{
+    return fetch_md<EVP_sha256>("SHA256");
+}
+
+inline const EVP_MD* md_md5()
+{
+    return fetch_md<EVP_md5>("MD5");
+}
+
+} // namespace detail
+
+// потоковый хеш на EVP_MD_CTX
+// контекст создается один раз, reset() переиспользует его
+template<std::size_t N, const EVP_MD* (*Md)()>
+class hasher final
+{
+public:
+    static constexpr auto size{N};
+    using result_type = std::array<unsigned char, N>;
+    using handle_type = EVP_MD_CTX*;
+
+private:
+    struct free_md_ctx
+    {
+        void operator()(handle_type ptr) noexcept
+        {
+            EVP_MD_CTX_free(ptr);
+        }
+    };
+    std::unique_ptr<EVP_MD_CTX, free_md_ctx> ctx_{EVP_MD_CTX_new()};
+
+public:
+    hasher()
+    {
+        if (!ctx_)
+            throw std::runtime_error("EVP_MD_CTX_new failed");
+        reset();
+    }
+
+    hasher(hasher&&) = default;
+    hasher& operator=(hasher&&) = default;
+
+    handle_type handle() const noexcept
+    {
+        return ctx_.get();
+    }
+
+    // начать новый хеш в том же контексте
+    void reset()
+    {
+        if (!EVP_DigestInit_ex(handle(), Md(), nullptr))
+            throw std::runtime_error("EVP_DigestInit_ex failed");
+    }
+
+    hasher& update(const void* buf, std::size_t len)
+    {
+        if (len && !EVP_DigestUpdate(handle(), buf, len))
+            throw std::runtime_error("EVP_DigestUpdate failed");
+        return *this;
+    }
+
+    hasher& update(std::string_view text)
+    {
+        return update(text.data(), text.size());
+    }
+
+    // первые len байт цепочки, по сегментам без pullup
+    hasher& update(e4pp::evbufer_ptr buf, std::size_t len)
+    {
+        assert(buf);
+
+        evbuffer_ptr pos;
+        evbuffer_ptr_set(buf, &pos, 0, EVBUFFER_PTR_SET);
+
+        constexpr int max_vec = 16;
+        evbuffer_iovec vec[max_vec];
+        while (len)
+        {
+            auto n = evbuffer_peek(buf,
+                static_cast<ev_ssize_t>(len), &pos, vec, max_vec);
+            if (n <= 0)
+                break;
+
+            std::size_t done = 0;
+            for (int i = 0; (i < n) && (i < max_vec) && len; ++i)
+            {
+                auto part = (std::min)(vec[i].iov_len, len);
+                update(vec[i].iov_base, part);
+                done += part;
+                len -= part;
+            }
+
+            if (len && (evbuffer_ptr_set(buf, &pos,
+                done, EVBUFFER_PTR_ADD) == -1))
+                break;
+        }
+
+        return *this;
+    }
+
+    template<class A>
+    hasher& update(const e4pp::basic_buffer<A>& buf)
+    {
+        return update(buf.handle(), buf.size());
+    }
+
+    template<class A>
+    hasher& update(const e4pp::basic_buffer<A>& buf, std::size_t len)
+    {
+        return update(buf.handle(), (std::min)(len, buf.size()));
+    }
+
+    // завершает хеш и сразу готовит контекст к следующему
+    void final(result_type& out)
+    {
+        if (!EVP_DigestFinal_ex(handle(), out.data(), nullptr))
+            throw std::runtime_error("EVP_DigestFinal_ex failed");
+        reset();
+    }
+
+    result_type final()
+    {
+        result_type rc;
+        final(rc);
+        return rc;
+    }
+
+    // пачка независимых сообщений через один контекст
+    // публичного multi-buffer api в openssl нет
+    template<class T>
+    void batch(std::span<const T> in, std::span<result_type> out)
+    {
+        assert(out.size() >= in.size());
+        for (std::size_t i = 0; i < in.size(); ++i)
+        {
+            update(in[i]);
+            final(out[i]);
+        }
+    }
+
+    static result_type digest(const void* buf, std::size_t len)
+    {
+        result_type rc;
+        if (!EVP_Digest(buf, len, rc.data(), nullptr, Md(), nullptr))
+            throw std::runtime_error("EVP_Digest failed");
+        return rc;
+    }
+};
+
+using sha1_hasher = hasher<SHA_DIGEST_LENGTH, detail::md_sha1>;
+using sha256_hasher = hasher<SHA256_DIGEST_LENGTH, detail::md_sha256>;
+using md5_hasher = hasher<MD5_DIGEST_LENGTH, detail::md_md5>;
+
+} // namespace openssl
+} // namespace e4ppx
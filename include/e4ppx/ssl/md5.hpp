@@ -1,5 +1,7 @@
 #pragma once
 
+#include "e4ppx/ssl/digest.hpp"
+
 #include <array>
 #include <stdexcept>
 #include <openssl/md5.h>
@@ -14,7 +16,8 @@ struct md5
 
     void operator()(const void *buf, std::size_t size) noexcept
     {
-        MD5(reinterpret_cast<const unsigned char*>(buf), size, hash.data());
+        EVP_Digest(buf, size, hash.data(), nullptr,
+            detail::md_md5(), nullptr);
     }
 
     template<class T>
@@ -1,8 +1,18 @@
 #pragma once
 
 #include <openssl/rand.h>
+#include <openssl/crypto.h>
+#include <atomic>
+#include <mutex>
+#include <array>
+#include <cstdint>
+#include <cstring>
 #include <stdexcept>
 
+#ifndef _WIN32
+#include <pthread.h>
+#endif // _WIN32
+
 namespace e4ppx {
 namespace openssl {
 
@@ -20,6 +30,112 @@ struct rand
     }
 };
 
+// буферизованный источник случайных байт на поток
+// пул заполняется одним RAND_bytes и раздается небольшими порциями,
+// например маски websocket по 4 байта
+// после fork пул потомка сбрасывается, чтобы процессы не раздавали
+// одинаковые байты
+class rand_pool final
+{
+public:
+    static constexpr std::size_t pool_size = 4096;
+
+private:
+    std::array<unsigned char, pool_size> pool_{};
+    std::size_t pos_{pool_size};
+    unsigned generation_{};
+
+    static std::atomic<unsigned>& fork_generation() noexcept
+    {
+        static std::atomic<unsigned> generation{};
+        return generation;
+    }
+
+    static unsigned current_generation() noexcept
+    {
+#ifndef _WIN32
+        static std::once_flag once;
+        std::call_once(once, []{
+            pthread_atfork(nullptr, nullptr, []{
+                fork_generation().fetch_add(1, std::memory_order_relaxed);
+            });
+        });
+#endif // _WIN32
+        return fork_generation().load(std::memory_order_relaxed);
+    }
+
+    bool refill() noexcept
+    {
+        if (RAND_bytes(pool_.data(), static_cast<int>(pool_.size())) != 1)
+            return false;
+        pos_ = 0;
+        return true;
+    }
+
+public:
+    rand_pool() = default;
+    rand_pool(const rand_pool&) = delete;
+    rand_pool& operator=(const rand_pool&) = delete;
+
+    ~rand_pool() noexcept
+    {
+        OPENSSL_cleanse(pool_.data(), pool_.size());
+    }
+
+    // пул текущего потока
+    static rand_pool& local() noexcept
+    {
+        thread_local rand_pool pool;
+        return pool;
+    }
+
+    // @return false если RAND_bytes не смог выдать данные
+    bool fill(void* out, std::size_t len) noexcept
+    {
+        auto generation = current_generation();
+        if (generation != generation_)
+        {
+            generation_ = generation;
+            pos_ = pool_size;
+        }
+
+        // большие запросы мимо пула
+        if (len > pool_size / 4)
+            return RAND_bytes(static_cast<unsigned char*>(out),
+                static_cast<int>(len)) == 1;
+
+        auto dst = static_cast<unsigned char*>(out);
+        while (len)
+        {
+            if ((pos_ == pool_size) && !refill())
+                return false;
+
+            auto part = (std::min)(len, pool_size - pos_);
+            auto src = pool_.data() + pos_;
+            std::memcpy(dst, src, part);
+            // выданные байты в пуле не остаются
+            OPENSSL_cleanse(src, part);
+            pos_ += part;
+            dst += part;
+            len -= part;
+        }
+
+        return true;
+    }
+
+    void operator()(unsigned char *out, std::size_t len)
+    {
+        if (!fill(out, len))
+            throw std::runtime_error("RAND_bytes");
+    }
+
+    std::uint32_t next_u32()
+    {
+        std::uint32_t rc;
+        this->operator()(reinterpret_cast<unsigned char*>(&rc), sizeof(rc));
+        return rc;
+    }
+};
 
 } // namepsace ssl
 } // namespace btpro
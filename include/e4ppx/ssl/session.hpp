@@ -2,6 +2,7 @@
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/x509v3.h>
+#include "e4ppx/ssl/session_cache.hpp"
 #include <memory>
 #include <stdexcept>
 
@@ -37,6 +38,16 @@ public:
         }
     }
 
+    // Client connection to host:port: sets SNI and expected hostname,
+    // resumes cached session if ctx is attached to a session_cache
+    session(SSL_CTX* ctx, const std::string& hostname, int port)
+        : session{ctx}
+    {
+        set_hostname(hostname);
+        if (auto cache = session_cache::attached(ctx))
+            cache->resume(handle(), hostname, port);
+    }
+
     handle_type handle() const noexcept
     {
         return ssl_.get();
@@ -53,6 +64,12 @@ public:
         SSL_set1_host(handle(), hostname.c_str());
     }
 
+    // Handshake was abbreviated using resumed session
+    bool reused() const noexcept
+    {
+        return SSL_session_reused(handle()) == 1;
+    }
+
     // Get peer certificate for verification
     std::unique_ptr<X509, void(*)(X509*)> get_peer_certificate() const
     {
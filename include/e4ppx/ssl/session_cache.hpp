@@ -0,0 +1,596 @@
+#pragma once
+
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cassert>
+#include <ctime>
+#include <stdexcept>
+#include <string_view>
+#include <shared_mutex>
+#include <unordered_map>
+
+namespace e4ppx {
+namespace openssl {
+
+struct session_cache_options
+{
+    // сессий на каждую сторону, старые вытесняются
+    std::size_t capacity{20480};
+    // время жизни серверной сессии
+    std::chrono::seconds timeout{7200};
+    // период смены ключа шифрования tickets
+    std::chrono::seconds ticket_rotation{3600};
+    // сколько ключей tickets принимается, включая текущий
+    std::size_t ticket_keys{3};
+};
+
+// общий кэш сессий TLS для нескольких SSL_CTX и потоков
+// сервер: session id во внешнем хранилище и tickets на своих
+// ротируемых ключах, так что resumption работает между контекстами
+// клиент: последняя SSL_SESSION на host:port, применяется в
+// session(ctx, host, port)
+// счетчики берутся из info callback контекста, установленный до
+// attach callback сохраняется и вызывается следом
+// кэш должен пережить все подключенные к нему контексты
+class session_cache final
+{
+public:
+    struct counters
+    {
+        // handshake завершен с resumption
+        std::uint64_t hits{};
+        // полный handshake
+        std::uint64_t misses{};
+        std::size_t server_sessions{};
+        std::size_t client_sessions{};
+    };
+
+private:
+    struct free_session
+    {
+        void operator()(SSL_SESSION* ptr) noexcept
+        {
+            SSL_SESSION_free(ptr);
+        }
+    };
+    using session_ptr = std::unique_ptr<SSL_SESSION, free_session>;
+
+    // LRU по строковому ключу
+    class store final
+    {
+        using node = std::pair<std::string, session_ptr>;
+        std::list<node> order_{};
+        std::unordered_map<std::string_view, std::list<node>::iterator> index_{};
+
+        static bool expired(SSL_SESSION* s) noexcept
+        {
+            auto now = static_cast<long>(std::time(nullptr));
+            return !SSL_SESSION_is_resumable(s) ||
+                (now >= SSL_SESSION_get_time(s) + SSL_SESSION_get_timeout(s));
+        }
+
+        void erase(std::list<node>::iterator i) noexcept
+        {
+            index_.erase(i->first);
+            order_.erase(i);
+        }
+
+    public:
+        void put(std::string key, session_ptr s, std::size_t capacity)
+        {
+            auto i = index_.find(key);
+            if (i != index_.end())
+                erase(i->second);
+
+            order_.emplace_front(std::move(key), std::move(s));
+            index_.emplace(order_.front().first, order_.begin());
+
+            while (order_.size() > capacity)
+                erase(std::prev(order_.end()));
+        }
+
+        // @return сессия с дополнительной ссылкой или nullptr
+        SSL_SESSION* get(std::string_view key)
+        {
+            auto i = index_.find(key);
+            if (i == index_.end())
+                return nullptr;
+
+            auto it = i->second;
+            if (expired(it->second.get()))
+            {
+                erase(it);
+                return nullptr;
+            }
+
+            order_.splice(order_.begin(), order_, it);
+            SSL_SESSION_up_ref(it->second.get());
+            return it->second.get();
+        }
+
+        void remove(std::string_view key) noexcept
+        {
+            auto i = index_.find(key);
+            if (i != index_.end())
+                erase(i->second);
+        }
+
+        std::size_t size() const noexcept
+        {
+            return order_.size();
+        }
+    };
+
+    struct ticket_key final
+    {
+        unsigned char name[16];
+        unsigned char aes[32];
+        unsigned char hmac[32];
+        std::chrono::steady_clock::time_point created;
+
+        ticket_key()
+            : created{std::chrono::steady_clock::now()}
+        {
+            if ((RAND_bytes(name, sizeof(name)) != 1) ||
+                (RAND_bytes(aes, sizeof(aes)) != 1) ||
+                (RAND_bytes(hmac, sizeof(hmac)) != 1))
+                throw std::runtime_error("RAND_bytes failed");
+        }
+
+        ~ticket_key()
+        {
+            OPENSSL_cleanse(aes, sizeof(aes));
+            OPENSSL_cleanse(hmac, sizeof(hmac));
+        }
+    };
+
+    // состояние соединения, живет в ex_data SSL
+    struct peer_state final
+    {
+        std::string peer{};
+        bool counted{};
+    };
+
+    using info_fun = void (*)(const SSL*, int, int);
+
+    // привязка контекста, живет в ex_data SSL_CTX
+    struct binding final
+    {
+        session_cache* cache{};
+        // info callback контекста до attach
+        info_fun info{};
+    };
+
+    session_cache_options options_{};
+    mutable std::mutex mutex_{};
+    store server_{};
+    store client_{};
+    mutable std::shared_mutex keys_mutex_{};
+    // первый ключ текущий, остальные только расшифровывают
+    std::vector<std::shared_ptr<const ticket_key>> keys_{};
+    std::atomic<std::uint64_t> hits_{};
+    std::atomic<std::uint64_t> misses_{};
+
+    static void free_peer_state(void*, void* ptr, CRYPTO_EX_DATA*,
+        int, long, void*) noexcept
+    {
+        delete static_cast<peer_state*>(ptr);
+    }
+
+    static void free_binding(void*, void* ptr, CRYPTO_EX_DATA*,
+        int, long, void*) noexcept
+    {
+        delete static_cast<binding*>(ptr);
+    }
+
+    static int ctx_index()
+    {
+        static const int idx = SSL_CTX_get_ex_new_index(0,
+            nullptr, nullptr, nullptr, free_binding);
+        if (idx < 0)
+            throw std::runtime_error("SSL_CTX_get_ex_new_index failed");
+        return idx;
+    }
+
+    static int ssl_index()
+    {
+        static const int idx = SSL_get_ex_new_index(0,
+            nullptr, nullptr, nullptr, free_peer_state);
+        if (idx < 0)
+            throw std::runtime_error("SSL_get_ex_new_index failed");
+        return idx;
+    }
+
+    static binding* binding_of(SSL_CTX* ctx) noexcept
+    {
+        return static_cast<binding*>(SSL_CTX_get_ex_data(ctx, ctx_index()));
+    }
+
+    static session_cache* from(SSL_CTX* ctx) noexcept
+    {
+        auto b = binding_of(ctx);
+        return b ? b->cache : nullptr;
+    }
+
+    static session_cache* from(SSL* ssl) noexcept
+    {
+        return from(SSL_get_SSL_CTX(ssl));
+    }
+
+    static peer_state* state(SSL* ssl)
+    {
+        auto idx = ssl_index();
+        auto p = static_cast<peer_state*>(SSL_get_ex_data(ssl, idx));
+        if (!p)
+        {
+            p = new peer_state{};
+            if (!SSL_set_ex_data(ssl, idx, p))
+            {
+                delete p;
+                throw std::runtime_error("SSL_set_ex_data failed");
+            }
+        }
+        return p;
+    }
+
+    static std::string_view id_of(const unsigned char* id,
+        std::size_t len) noexcept
+    {
+        return {reinterpret_cast<const char*>(id), len};
+    }
+
+    static std::string_view id_of(SSL_SESSION* s) noexcept
+    {
+        unsigned int len = 0;
+        auto id = SSL_SESSION_get_id(s, &len);
+        return id_of(id, len);
+    }
+
+    // на TLS 1.3 ticket одноразовый (RFC 8446 C.4)
+    static bool single_use(SSL_SESSION* s) noexcept
+    {
+        return SSL_SESSION_get_protocol_version(s) >= TLS1_3_VERSION;
+    }
+
+    static void info(const SSL* ssl, int where, int ret) noexcept
+    {
+        auto s = const_cast<SSL*>(ssl);
+        auto b = binding_of(SSL_get_SSL_CTX(s));
+        if (b && b->info)
+            b->info(ssl, where, ret);
+
+        if (!b || !(where & SSL_CB_HANDSHAKE_DONE))
+            return;
+
+        auto cache = b->cache;
+
+        // на TLS 1.3 HANDSHAKE_DONE приходит и с каждым NewSessionTicket
+        try {
+            auto p = state(s);
+            if (p->counted)
+                return;
+            p->counted = true;
+        }
+        catch (...)
+        {
+            return;
+        }
+
+        auto& counter = SSL_session_reused(s) ?
+            cache->hits_ : cache->misses_;
+        counter.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static int new_server_session(SSL* ssl, SSL_SESSION* s) noexcept
+    {
+        auto cache = from(ssl);
+        if (!cache)
+            return 0;
+
+        try {
+            std::string key{id_of(s)};
+            std::lock_guard<std::mutex> l{cache->mutex_};
+            cache->server_.put(std::move(key), session_ptr{s},
+                cache->options_.capacity);
+            return 1;
+        }
+        catch (...)
+        {   }
+        return 0;
+    }
+
+    static SSL_SESSION* get_server_session(SSL* ssl,
+        const unsigned char* id, int len, int* copy) noexcept
+    {
+        *copy = 0;
+        auto cache = from(ssl);
+        if (!cache)
+            return nullptr;
+
+        std::lock_guard<std::mutex> l{cache->mutex_};
+        return cache->server_.get(id_of(id, static_cast<std::size_t>(len)));
+    }
+
+    static void remove_server_session(SSL_CTX* ctx, SSL_SESSION* s) noexcept
+    {
+        auto cache = from(ctx);
+        if (!cache)
+            return;
+
+        std::lock_guard<std::mutex> l{cache->mutex_};
+        cache->server_.remove(id_of(s));
+    }
+
+    static int new_client_session(SSL* ssl, SSL_SESSION* s) noexcept
+    {
+        auto cache = from(ssl);
+        auto p = static_cast<peer_state*>(SSL_get_ex_data(ssl, ssl_index()));
+        if (!cache || !p || p->peer.empty())
+            return 0;
+
+        try {
+            std::lock_guard<std::mutex> l{cache->mutex_};
+            cache->client_.put(p->peer, session_ptr{s},
+                cache->options_.capacity);
+            return 1;
+        }
+        catch (...)
+        {   }
+        return 0;
+    }
+
+    bool stale(const ticket_key& k) const noexcept
+    {
+        return std::chrono::steady_clock::now() - k.created >=
+            options_.ticket_rotation;
+    }
+
+    void rotate(bool force)
+    {
+        auto k = std::make_shared<const ticket_key>();
+        std::unique_lock<std::shared_mutex> l{keys_mutex_};
+        // ключ мог смениться пока создавался новый
+        if (!force && !stale(*keys_.front()))
+            return;
+        keys_.insert(keys_.begin(), std::move(k));
+        if (keys_.size() > options_.ticket_keys)
+            keys_.resize(options_.ticket_keys);
+    }
+
+    // текущий ключ, при истечении периода создается новый
+    std::shared_ptr<const ticket_key> current_key()
+    {
+        {
+            std::shared_lock<std::shared_mutex> l{keys_mutex_};
+            if (!stale(*keys_.front()))
+                return keys_.front();
+        }
+        rotate(false);
+        std::shared_lock<std::shared_mutex> l{keys_mutex_};
+        return keys_.front();
+    }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    using mac_ctx = EVP_MAC_CTX;
+
+    static bool set_hmac(EVP_MAC_CTX* hctx, const ticket_key& k) noexcept
+    {
+        OSSL_PARAM params[] = {
+            OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+                const_cast<unsigned char*>(k.hmac), sizeof(k.hmac)),
+            OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                const_cast<char*>("SHA256"), 0),
+            OSSL_PARAM_construct_end()
+        };
+        return EVP_MAC_CTX_set_params(hctx, params) == 1;
+    }
+#else
+    using mac_ctx = HMAC_CTX;
+
+    static bool set_hmac(HMAC_CTX* hctx, const ticket_key& k) noexcept
+    {
+        return HMAC_Init_ex(hctx, k.hmac, sizeof(k.hmac),
+            EVP_sha256(), nullptr) == 1;
+    }
+#endif
+
+    static int ticket_key_cb(SSL* ssl, unsigned char* name,
+        unsigned char* iv, EVP_CIPHER_CTX* cctx, mac_ctx* hctx,
+        int enc) noexcept
+    {
+        auto cache = from(ssl);
+        if (!cache)
+            return -1;
+
+        try {
+            if (enc)
+            {
+                auto key = cache->current_key();
+                auto& k = *key;
+                auto iv_len = EVP_CIPHER_iv_length(EVP_aes_256_cbc());
+                if ((RAND_bytes(iv, iv_len) != 1) ||
+                    (EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(),
+                        nullptr, k.aes, iv) != 1) ||
+                    !set_hmac(hctx, k))
+                    return -1;
+                std::memcpy(name, k.name, sizeof(k.name));
+                return 1;
+            }
+
+            decltype(cache->keys_) keys;
+            {
+                std::shared_lock<std::shared_mutex> l{cache->keys_mutex_};
+                keys = cache->keys_;
+            }
+            for (std::size_t i = 0; i < keys.size(); ++i)
+            {
+                auto& k = *keys[i];
+                if (std::memcmp(name, k.name, sizeof(k.name)))
+                    continue;
+                if ((EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(),
+                        nullptr, k.aes, iv) != 1) || !set_hmac(hctx, k))
+                    return -1;
+                // ticket на старом ключе принимается и перевыпускается,
+                // на TLS 1.3 клиент использует ticket один раз, поэтому
+                // новый выдается всегда
+                return (i || (SSL_version(ssl) >= TLS1_3_VERSION)) ? 2 : 1;
+            }
+        }
+        catch (...)
+        {
+            return -1;
+        }
+        // неизвестный ключ - полный handshake
+        return 0;
+    }
+
+    void bind(SSL_CTX* ctx)
+    {
+        assert(ctx);
+        auto prev = binding_of(ctx);
+        if (prev && (prev->cache != this))
+            throw std::runtime_error("session_cache already attached");
+        // индекс SSL выделяется заранее, не в колбеке
+        ssl_index();
+        if (prev)
+            return;
+
+        auto b = std::make_unique<binding>(binding{this,
+            SSL_CTX_get_info_callback(ctx)});
+        if (!SSL_CTX_set_ex_data(ctx, ctx_index(), b.get()))
+            throw std::runtime_error("SSL_CTX_set_ex_data failed");
+        b.release();
+        SSL_CTX_set_info_callback(ctx, info);
+    }
+
+public:
+    explicit session_cache(const session_cache_options& options = {})
+        : options_{options}
+    {
+        if (!options_.capacity || !options_.ticket_keys)
+            throw std::invalid_argument("session_cache_options");
+        keys_.push_back(std::make_shared<const ticket_key>());
+    }
+
+    session_cache(const session_cache&) = delete;
+    session_cache& operator=(const session_cache&) = delete;
+
+    const session_cache_options& options() const noexcept
+    {
+        return options_;
+    }
+
+    // серверный контекст: session id и tickets
+    // id_context должен совпадать у контекстов, между которыми
+    // сессии переносятся, например у всех SNI контекстов
+    void attach_server(SSL_CTX* ctx, std::string_view id_context = "e4ppx")
+    {
+        bind(ctx);
+        if (!SSL_CTX_set_session_id_context(ctx,
+            reinterpret_cast<const unsigned char*>(id_context.data()),
+            static_cast<unsigned>(id_context.size())))
+            throw std::runtime_error("SSL_CTX_set_session_id_context failed");
+
+        SSL_CTX_set_session_cache_mode(ctx,
+            SSL_SESS_CACHE_SERVER|SSL_SESS_CACHE_NO_INTERNAL);
+        SSL_CTX_set_timeout(ctx, static_cast<long>(options_.timeout.count()));
+        SSL_CTX_sess_set_new_cb(ctx, new_server_session);
+        SSL_CTX_sess_set_get_cb(ctx, get_server_session);
+        SSL_CTX_sess_set_remove_cb(ctx, remove_server_session);
+        SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        if (!SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_cb))
+            throw std::runtime_error("SSL_CTX_set_tlsext_ticket_key_evp_cb failed");
+#else
+        if (!SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticket_key_cb))
+            throw std::runtime_error("SSL_CTX_set_tlsext_ticket_key_cb failed");
+#endif
+    }
+
+    // клиентский контекст: сессии сохраняются по host:port
+    void attach_client(SSL_CTX* ctx)
+    {
+        bind(ctx);
+        SSL_CTX_set_session_cache_mode(ctx,
+            SSL_SESS_CACHE_CLIENT|SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(ctx, new_client_session);
+    }
+
+    static session_cache* attached(SSL_CTX* ctx) noexcept
+    {
+        return ctx ? from(ctx) : nullptr;
+    }
+
+    static std::string peer_key(std::string_view host, int port)
+    {
+        std::string rc{host};
+        rc += ':';
+        rc += std::to_string(port);
+        return rc;
+    }
+
+    // запоминает peer соединения и подставляет сохраненную сессию
+    // вызывается до начала handshake
+    // @return true если сессия найдена
+    bool resume(SSL* ssl, std::string_view host, int port)
+    {
+        assert(ssl);
+        auto p = state(ssl);
+        p->peer = peer_key(host, port);
+
+        session_ptr s;
+        {
+            std::lock_guard<std::mutex> l{mutex_};
+            s.reset(client_.get(p->peer));
+            if (s && single_use(s.get()))
+                client_.remove(p->peer);
+        }
+
+        if (!s)
+            return false;
+        return SSL_set_session(ssl, s.get()) == 1;
+    }
+
+    // новый текущий ключ tickets, старые принимаются еще
+    // ticket_keys - 1 ротаций
+    void rotate_ticket_keys()
+    {
+        rotate(true);
+    }
+
+    // сбрасывает сессии обеих сторон, ключи tickets остаются
+    void flush() noexcept
+    {
+        std::lock_guard<std::mutex> l{mutex_};
+        server_ = store{};
+        client_ = store{};
+    }
+
+    counters stats() const
+    {
+        counters rc;
+        rc.hits = hits_.load(std::memory_order_relaxed);
+        rc.misses = misses_.load(std::memory_order_relaxed);
+        std::lock_guard<std::mutex> l{mutex_};
+        rc.server_sessions = server_.size();
+        rc.client_sessions = client_.size();
+        return rc;
+    }
+};
+
+} // namespace openssl
+} // namespace e4ppx
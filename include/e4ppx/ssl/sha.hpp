@@ -1,5 +1,7 @@
 #pragma once
 
+#include "e4ppx/ssl/digest.hpp"
+
 #include <array>
 #include <stdexcept>
 #include <openssl/sha.h>
@@ -14,7 +16,8 @@ struct sha1
 
     void operator()(const void *buf, std::size_t size) noexcept
     {
-        SHA1(reinterpret_cast<const unsigned char*>(buf), size, data.data());
+        EVP_Digest(buf, size, data.data(), nullptr,
+            detail::md_sha1(), nullptr);
     }
 
     template<class T>
@@ -31,7 +34,8 @@ struct sha256
 
     void operator()(const void *buf, std::size_t size) noexcept
     {
-        SHA256(reinterpret_cast<const unsigned char*>(buf), size, data.data());
+        EVP_Digest(buf, size, data.data(), nullptr,
+            detail::md_sha256(), nullptr);
     }
 
     template<class T>
@@ -0,0 +1,330 @@
+#pragma once
+
+#include "e4ppx/ssl/context.hpp"
+#include "e4pp/functional.hpp"
+
+#include <openssl/x509v3.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <memory>
+#include <string>
+#include <vector>
+#include <exception>
+#include <functional>
+#include <string_view>
+#include <unordered_map>
+
+namespace e4ppx {
+namespace openssl {
+
+// сертификаты серверов по SNI
+// каждая пара cert/key загружается в свой SSL_CTX заранее, имена
+// берутся из subjectAltName (или CN) либо задаются явно
+// поиск в servername callback: точное имя, затем *.parent,
+// оба по хэшу, без перебора
+// перезагрузка строит новую таблицу в отдельном потоке и подменяет
+// текущую атомарно, установленные соединения держат свой SSL_CTX
+class cert_store final
+{
+public:
+    // настройка каждого загруженного контекста, например
+    // session_cache::attach_server с общим id_context
+    using configure_fun = std::function<void(SSL_CTX*)>;
+    // вызывается в очереди reload, error пустой при успехе
+    using reload_fun = std::function<void(std::exception_ptr error)>;
+
+private:
+    struct source final
+    {
+        std::string cert_file{};
+        std::string key_file{};
+        std::vector<std::string> names{};
+    };
+
+    struct free_ssl_ctx
+    {
+        void operator()(SSL_CTX* ptr) noexcept
+        {
+            SSL_CTX_free(ptr);
+        }
+    };
+    using ctx_ptr = std::unique_ptr<SSL_CTX, free_ssl_ctx>;
+
+    // неизменяемый снимок, читается без блокировок
+    struct table final
+    {
+        std::vector<ctx_ptr> contexts{};
+        std::unordered_map<std::string, SSL_CTX*> exact{};
+        // *.example.com хранится под example.com
+        std::unordered_map<std::string, SSL_CTX*> wildcard{};
+    };
+    using table_ptr = std::shared_ptr<const table>;
+
+    // запрос reload, ждущий следующей сборки
+    struct request final
+    {
+        e4pp::queue_handle_type queue{};
+        reload_fun fn{};
+    };
+
+    configure_fun configure_{};
+    std::mutex mutex_{};
+    std::vector<source> sources_{};
+    std::atomic<table_ptr> table_{std::make_shared<const table>()};
+    std::thread reload_{};
+    // под mutex_: поток сборки работает и запросы для него
+    bool reloading_{};
+    std::vector<request> requests_{};
+
+    static std::string lower(std::string_view s)
+    {
+        std::string rc{s};
+        for (auto& c : rc)
+        {
+            if ((c >= 'A') && (c <= 'Z'))
+                c = static_cast<char>(c - 'A' + 'a');
+        }
+        return rc;
+    }
+
+    static std::vector<std::string> names_of(SSL_CTX* ctx)
+    {
+        std::vector<std::string> rc;
+        auto cert = SSL_CTX_get0_certificate(ctx);
+        if (!cert)
+            return rc;
+
+        auto alt = static_cast<GENERAL_NAMES*>(X509_get_ext_d2i(cert,
+            NID_subject_alt_name, nullptr, nullptr));
+        if (alt)
+        {
+            for (int i = 0; i < sk_GENERAL_NAME_num(alt); ++i)
+            {
+                auto n = sk_GENERAL_NAME_value(alt, i);
+                if (n->type != GEN_DNS)
+                    continue;
+                auto s = n->d.dNSName;
+                rc.emplace_back(reinterpret_cast<const char*>(
+                    ASN1_STRING_get0_data(s)),
+                    static_cast<std::size_t>(ASN1_STRING_length(s)));
+            }
+            GENERAL_NAMES_free(alt);
+        }
+
+        // без subjectAltName используется CN
+        if (rc.empty())
+        {
+            char cn[256];
+            auto len = X509_NAME_get_text_by_NID(X509_get_subject_name(cert),
+                NID_commonName, cn, sizeof(cn));
+            if (len > 0)
+                rc.emplace_back(cn, static_cast<std::size_t>(len));
+        }
+        return rc;
+    }
+
+    // первое добавленное имя выигрывает, как у порядка add
+    static void index(table& t, std::string_view name, SSL_CTX* ctx)
+    {
+        auto n = lower(name);
+        if ((n.size() > 2) && (n[0] == '*') && (n[1] == '.'))
+            t.wildcard.emplace(n.substr(2), ctx);
+        else if (!n.empty())
+            t.exact.emplace(std::move(n), ctx);
+    }
+
+    table_ptr build(const std::vector<source>& sources) const
+    {
+        auto t = std::make_shared<table>();
+        for (auto& s : sources)
+        {
+            auto ctx = context::create_server(s.cert_file, s.key_file);
+            if (configure_)
+                configure_(ctx.handle());
+            t->contexts.emplace_back(ctx.release());
+
+            auto handle = t->contexts.back().get();
+            auto names = s.names.empty() ? names_of(handle) : s.names;
+            for (auto& n : names)
+                index(*t, n, handle);
+        }
+        return t;
+    }
+
+    std::vector<source> sources()
+    {
+        std::lock_guard<std::mutex> l{mutex_};
+        return sources_;
+    }
+
+    static void notify(const request& r, std::exception_ptr error) noexcept
+    {
+        if (!r.fn || !r.queue)
+            return;
+
+        try {
+            auto p = e4pp::proxy_call(e4pp::timer_fun{[fn = r.fn, error]{
+                fn(error);
+            }});
+            timeval tv{};
+            if (event_base_once(r.queue, -1, EV_TIMEOUT,
+                p.second, p.first, &tv) == -1)
+                delete p.first;
+        }
+        catch (...)
+        {   }
+    }
+
+    // поток reload: сборка, пока есть запросы
+    void run() noexcept
+    {
+        std::unique_lock<std::mutex> l{mutex_};
+        while (!requests_.empty())
+        {
+            auto batch = std::move(requests_);
+            requests_.clear();
+            l.unlock();
+
+            std::exception_ptr error;
+            try {
+                table_.store(build(sources()), std::memory_order_release);
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+            }
+
+            for (auto& r : batch)
+                notify(r, error);
+            l.lock();
+        }
+        reloading_ = false;
+    }
+
+    void join() noexcept
+    {
+        if (reload_.joinable() &&
+            (reload_.get_id() != std::this_thread::get_id()))
+            reload_.join();
+    }
+
+    static int servername(SSL* ssl, int*, void* arg) noexcept
+    {
+        auto host = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+        if (!host)
+            return SSL_TLSEXT_ERR_OK;
+
+        // неизвестное имя обслуживает контекст слушателя
+        try {
+            auto self = static_cast<cert_store*>(arg);
+            auto t = self->table_.load(std::memory_order_acquire);
+            auto ctx = find(*t, lower(host));
+            if (ctx && (ctx != SSL_get_SSL_CTX(ssl)))
+                SSL_set_SSL_CTX(ssl, ctx);
+        }
+        catch (...)
+        {   }
+        return SSL_TLSEXT_ERR_OK;
+    }
+
+    static SSL_CTX* find(const table& t, const std::string& host) noexcept
+    {
+        auto i = t.exact.find(host);
+        if (i != t.exact.end())
+            return i->second;
+
+        // wildcard покрывает ровно одну метку
+        auto dot = host.find('.');
+        if ((dot == std::string::npos) || (dot == 0))
+            return nullptr;
+        auto w = t.wildcard.find(host.substr(dot + 1));
+        return (w != t.wildcard.end()) ? w->second : nullptr;
+    }
+
+public:
+    explicit cert_store(configure_fun configure = {})
+        : configure_{std::move(configure)}
+    {   }
+
+    cert_store(const cert_store&) = delete;
+    cert_store& operator=(const cert_store&) = delete;
+
+    ~cert_store()
+    {
+        join();
+    }
+
+    // names пустой - имена из сертификата
+    // вступает в силу после load или reload
+    void add(std::string cert_file, std::string key_file,
+        std::vector<std::string> names = {})
+    {
+        std::lock_guard<std::mutex> l{mutex_};
+        sources_.push_back(source{std::move(cert_file),
+            std::move(key_file), std::move(names)});
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> l{mutex_};
+        sources_.clear();
+    }
+
+    // синхронная загрузка, при ошибке текущая таблица остается
+    void load()
+    {
+        table_.store(build(sources()), std::memory_order_release);
+    }
+
+    // загрузка в отдельном потоке, очередь не ждет разбора PEM
+    // fn вызывается в потоке queue (нужен e4pp::use_threads)
+    // запросы во время сборки не ждут ее: поток после нее собирает
+    // таблицу еще раз, один раз на все накопленные запросы
+    void reload(e4pp::queue_handle_type queue, reload_fun fn = {})
+    {
+        std::lock_guard<std::mutex> l{mutex_};
+        requests_.push_back(request{queue, std::move(fn)});
+        if (reloading_)
+            return;
+
+        // прошлый поток уже вышел из цикла сборки
+        if (reload_.joinable())
+            reload_.join();
+        try {
+            reload_ = std::thread{[this]{
+                run();
+            }};
+        }
+        catch (...)
+        {
+            requests_.pop_back();
+            throw;
+        }
+        reloading_ = true;
+    }
+    // устанавливает servername callback на контекст слушателя
+    // store должен пережить ctx
+    void attach(SSL_CTX* ctx) noexcept
+    {
+        assert(ctx);
+        SSL_CTX_set_tlsext_servername_callback(ctx, servername);
+        SSL_CTX_set_tlsext_servername_arg(ctx, this);
+    }
+
+    // контекст для имени из текущей таблицы или nullptr
+    // указатель действителен до следующей перезагрузки
+    SSL_CTX* find(std::string_view host) const
+    {
+        auto t = table_.load(std::memory_order_acquire);
+        return find(*t, lower(host));
+    }
+
+    std::size_t size() const noexcept
+    {
+        return table_.load(std::memory_order_acquire)->contexts.size();
+    }
+};
+
+} // namespace openssl
+} // namespace e4ppx
@@ -0,0 +1,273 @@
+#pragma once
+
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/x509_vfy.h>
+#include <openssl/evp.h>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <string>
+#include <cstdint>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace e4ppx {
+namespace openssl {
+
+// системные CA один раз на процесс
+// хранилище загружается при первом обращении и дальше не меняется,
+// контексты получают его по ссылке (SSL_CTX_set1_cert_store),
+// поэтому в контекст с общим хранилищем нельзя добавлять CA через
+// SSL_CTX_load_verify_locations - для своих CA нужно свое хранилище
+class trust_store final
+{
+    struct holder final
+    {
+        X509_STORE* store{};
+
+        holder()
+            : store{X509_STORE_new()}
+        {
+            if (!store)
+                throw std::runtime_error("X509_STORE_new failed");
+            if (X509_STORE_set_default_paths(store) != 1)
+            {
+                X509_STORE_free(store);
+                throw std::runtime_error("X509_STORE_set_default_paths failed");
+            }
+        }
+
+        ~holder()
+        {
+            X509_STORE_free(store);
+        }
+    };
+
+public:
+    // общее хранилище, владелец - процесс
+    static X509_STORE* system()
+    {
+        static holder h;
+        return h.store;
+    }
+
+    // контекст разделяет хранилище со счетчиком ссылок
+    static void attach(SSL_CTX* ctx)
+    {
+        SSL_CTX_set1_cert_store(ctx, system());
+    }
+};
+
+// ожидаемые имя и IP из X509_VERIFY_PARAM читаются с OpenSSL 3.0,
+// без них ключ кэша неполный, поэтому раньше кэша нет
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+struct chain_cache_options
+{
+    std::size_t capacity{4096};
+    // результат проверки хранится не дольше ttl и не дольше
+    // срока действия любого сертификата цепочки
+    std::chrono::seconds ttl{3600};
+};
+
+// кэш успешных проверок цепочек сертификатов сервера
+// ключ - SHA-256 сертификата пира, ожидаемые имя и IP, хранилище,
+// роль, verify callback и параметры проверки (флаги, глубина,
+// уровень безопасности), при совпадении X509_verify_cert не вызывается
+// purpose и trust параметров до OpenSSL 3.2 не читаются, контексты
+// с разными SSL_CTX_set_purpose/set_trust не должны делить кэш
+// на попадании не вызывается verify callback контекста и
+// SSL_get0_verified_chain пуст
+class chain_cache final
+{
+public:
+    struct counters
+    {
+        std::uint64_t hits{};
+        std::uint64_t misses{};
+        std::size_t size{};
+    };
+
+private:
+    chain_cache_options options_{};
+    mutable std::mutex mutex_{};
+    std::unordered_map<std::string, std::time_t> entries_{};
+    std::atomic<std::uint64_t> hits_{};
+    std::atomic<std::uint64_t> misses_{};
+
+    static bool make_key(X509_STORE_CTX* ctx, std::string& key)
+    {
+        auto cert = X509_STORE_CTX_get0_cert(ctx);
+        if (!cert)
+            return false;
+
+        unsigned char md[EVP_MAX_MD_SIZE];
+        unsigned int len = 0;
+        if (X509_digest(cert, EVP_sha256(), md, &len) != 1)
+            return false;
+
+        key.assign(reinterpret_cast<const char*>(md), len);
+        auto store = X509_STORE_CTX_get0_store(ctx);
+        key.append(reinterpret_cast<const char*>(&store), sizeof(store));
+
+        // хранилище общее для контекстов (trust_store::system),
+        // успех при мягких параметрах не годится для строгих
+        auto param = X509_STORE_CTX_get0_param(ctx);
+        auto ssl = static_cast<SSL*>(X509_STORE_CTX_get_ex_data(ctx,
+            SSL_get_ex_data_X509_STORE_CTX_idx()));
+        struct
+        {
+            unsigned long flags;
+            unsigned int hostflags;
+            int depth;
+            int auth_level;
+            int server;
+            std::time_t check_time;
+            X509_STORE_CTX_verify_cb verify_cb;
+        } bits{};
+        bits.flags = X509_VERIFY_PARAM_get_flags(param);
+        bits.hostflags = X509_VERIFY_PARAM_get_hostflags(param);
+        bits.depth = X509_VERIFY_PARAM_get_depth(param);
+        bits.auth_level = X509_VERIFY_PARAM_get_auth_level(param);
+        bits.server = ssl ? SSL_is_server(ssl) : -1;
+        if (bits.flags & X509_V_FLAG_USE_CHECK_TIME)
+            bits.check_time = X509_VERIFY_PARAM_get_time(param);
+        bits.verify_cb = X509_STORE_CTX_get_verify_cb(ctx);
+        key.append(reinterpret_cast<const char*>(&bits), sizeof(bits));
+#if OPENSSL_VERSION_NUMBER >= 0x30200000L
+        auto purpose = X509_VERIFY_PARAM_get_purpose(param);
+        key.append(reinterpret_cast<const char*>(&purpose), sizeof(purpose));
+#endif
+
+        for (int i = 0; auto host = X509_VERIFY_PARAM_get0_host(param, i); ++i)
+        {
+            key += '\0';
+            key += host;
+        }
+
+        if (auto ip = X509_VERIFY_PARAM_get1_ip_asc(param))
+        {
+            key += '\1';
+            key += ip;
+            OPENSSL_free(ip);
+        }
+        return true;
+    }
+
+    // ближайший notAfter в проверенной цепочке
+    std::time_t expires(X509_STORE_CTX* ctx) const noexcept
+    {
+        auto now = std::time(nullptr);
+        auto rc = now + static_cast<std::time_t>(options_.ttl.count());
+
+        auto chain = X509_STORE_CTX_get0_chain(ctx);
+        for (int i = 0; i < sk_X509_num(chain); ++i)
+        {
+            int days = 0;
+            int secs = 0;
+            auto cert = sk_X509_value(chain, i);
+            if (!ASN1_TIME_diff(&days, &secs, nullptr, X509_get0_notAfter(cert)))
+                return now;
+            auto left = static_cast<std::time_t>(days) * 86400 + secs;
+            if (now + left < rc)
+                rc = now + left;
+        }
+        return rc;
+    }
+
+    bool find(const std::string& key)
+    {
+        std::lock_guard<std::mutex> l{mutex_};
+        auto i = entries_.find(key);
+        if (i == entries_.end())
+            return false;
+        if (std::time(nullptr) < i->second)
+            return true;
+        entries_.erase(i);
+        return false;
+    }
+
+    void insert(std::string key, std::time_t expires)
+    {
+        std::lock_guard<std::mutex> l{mutex_};
+        if (entries_.size() >= options_.capacity)
+        {
+            auto now = std::time(nullptr);
+            for (auto i = entries_.begin(); i != entries_.end(); )
+                i = (i->second <= now) ? entries_.erase(i) : std::next(i);
+            // без LRU: места нет - вытесняется произвольная запись
+            if (entries_.size() >= options_.capacity)
+                entries_.erase(entries_.begin());
+        }
+        entries_.insert_or_assign(std::move(key), expires);
+    }
+
+    static int verify(X509_STORE_CTX* ctx, void* arg) noexcept
+    {
+        auto self = static_cast<chain_cache*>(arg);
+        std::string key;
+        try {
+            if (make_key(ctx, key) && self->find(key))
+            {
+                self->hits_.fetch_add(1, std::memory_order_relaxed);
+                X509_STORE_CTX_set_error(ctx, X509_V_OK);
+                return 1;
+            }
+        }
+        catch (...)
+        {
+            key.clear();
+        }
+
+        self->misses_.fetch_add(1, std::memory_order_relaxed);
+        auto rc = X509_verify_cert(ctx);
+        if ((rc == 1) && !key.empty())
+        {
+            try {
+                self->insert(std::move(key), self->expires(ctx));
+            }
+            catch (...)
+            {   }
+        }
+        return rc;
+    }
+
+public:
+    explicit chain_cache(const chain_cache_options& options = {})
+        : options_{options}
+    {
+        if (!options_.capacity)
+            throw std::invalid_argument("chain_cache_options");
+    }
+
+    chain_cache(const chain_cache&) = delete;
+    chain_cache& operator=(const chain_cache&) = delete;
+
+    // кэш должен пережить контекст, может быть общим для контекстов
+    // с одинаковыми purpose и trust
+    void attach(SSL_CTX* ctx) noexcept
+    {
+        SSL_CTX_set_cert_verify_callback(ctx, verify, this);
+    }
+
+    void clear() noexcept
+    {
+        std::lock_guard<std::mutex> l{mutex_};
+        entries_.clear();
+    }
+
+    counters stats() const
+    {
+        counters rc;
+        rc.hits = hits_.load(std::memory_order_relaxed);
+        rc.misses = misses_.load(std::memory_order_relaxed);
+        std::lock_guard<std::mutex> l{mutex_};
+        rc.size = entries_.size();
+        return rc;
+    }
+};
+#endif // OPENSSL_VERSION_NUMBER >= 0x30000000L
+
+} // namespace openssl
+} // namespace e4ppx